@@ -10,11 +10,6 @@
 
 namespace GrabCutNS {
 
-Real distance2( const Color& c1, const Color& c2 )
-{
-	return ((c1.r-c2.r)*(c1.r-c2.r)+(c1.g-c2.g)*(c1.g-c2.g)+(c1.b-c2.b)*(c1.b-c2.b));
-}
-
 //Image<Color>* _loadFromPGM( std::string file_name );
 //Image<Color>* _loadFromPPM( std::string file_name );
 //Image<Color>* _loadWithQt( std::string file_name );
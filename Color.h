@@ -14,18 +14,142 @@
 
 namespace GrabCutNS {
 
-class Color {
+// A color of N channels of precision T, normally in [0,1] as produced by the image loader. The channel
+// counts in use are specialized: gray (1), RGB (3, the Color used everywhere else) and RGB plus an extra
+// channel such as depth or near infrared (4). All of them index their channels with [].
+template <unsigned int N, typename T = Real>
+class ColorN {
 
 public:
 
-	Color() : r(0), g(0), b(0) {}
-	Color(Real _r, Real _g, Real _b) : r(_r), g(_g), b(_b) {}
+	ColorN() { for (unsigned int i = 0; i < N; i++) v[i] = 0; }
 
-	Real r, g, b;
+	T& operator[](unsigned int i)				{ return v[i]; }
+	const T& operator[](unsigned int i) const	{ return v[i]; }
+
+	T v[N];
+};
+
+template <typename T>
+class ColorN<1, T> {
+
+public:
+
+	ColorN() : v(0) {}
+	explicit ColorN(T _v) : v(_v) {}
+
+	T& operator[](unsigned int)				{ return v; }
+	const T& operator[](unsigned int) const	{ return v; }
+
+	T v;
+};
+
+template <typename T>
+class ColorN<3, T> {
+
+public:
+
+	ColorN() : r(0), g(0), b(0) {}
+	ColorN(T _r, T _g, T _b) : r(_r), g(_g), b(_b) {}
+
+	// r, g and b are laid out as an array
+	T& operator[](unsigned int i)				{ return (&r)[i]; }
+	const T& operator[](unsigned int i) const	{ return (&r)[i]; }
+
+	T r, g, b;
+};
+
+template <typename T>
+class ColorN<4, T> {
+
+public:
+
+	ColorN() { v[0] = v[1] = v[2] = v[3] = 0; }
+	ColorN(T _r, T _g, T _b, T _x) { v[0] = _r; v[1] = _g; v[2] = _b; v[3] = _x; }
+
+	T& operator[](unsigned int i)				{ return v[i]; }
+	const T& operator[](unsigned int i) const	{ return v[i]; }
+
+	T v[4];
 };
 
+typedef ColorN<3> Color;
+
+// Colors can also be stored with 8-bit channels, as decoded from image files, a quarter of the size of
+// float ones. A stored level i stands for i/255; computations convert to their precision on the fly.
+typedef ColorN<3, unsigned char> Color8;
+
+// Table of the 256 levels in precision T, built at startup
+template <typename T>
+struct ColorLevels
+{
+	ColorLevels() { for (unsigned int i = 0; i < 256; ++i) v[i] = (T)i / 255; }
+
+	T v[256];
+
+	static const ColorLevels table;
+};
+
+template <typename T>
+const ColorLevels<T> ColorLevels<T>::table;
+
+// A stored channel in precision T: unchanged if stored in T, looked up if stored in 8 bits
+template <typename T>
+inline T level(T c)
+{
+	return c;
+}
+
+template <typename T>
+inline T level(unsigned char c)
+{
+	return ColorLevels<T>::table.v[c];
+}
+
+// A stored color in precision T
+template <typename T, unsigned int N>
+inline const ColorN<N, T>& toColor(const ColorN<N, T>& c)
+{
+	return c;
+}
+
+template <typename T, unsigned int N>
+inline ColorN<N, T> toColor(const ColorN<N, unsigned char>& c)
+{
+	ColorN<N, T> result;
+	for (unsigned int k = 0; k < N; k++)
+		result[k] = level<T>(c[k]);
+	return result;
+}
+
 // Compute squared distance between two colors
-Real distance2( const Color& c1, const Color& c2 );
+template <unsigned int N, typename T>
+inline T distance2( const ColorN<N, T>& c1, const ColorN<N, T>& c2 )
+{
+	T result = 0;
+	for (unsigned int i = 0; i < N; i++)
+		result += (c1[i]-c2[i])*(c1[i]-c2[i]);
+	return result;
+}
+
+template <typename T>
+inline T distance2( const ColorN<1, T>& c1, const ColorN<1, T>& c2 )
+{
+	return (c1.v-c2.v)*(c1.v-c2.v);
+}
+
+template <typename T>
+inline T distance2( const ColorN<3, T>& c1, const ColorN<3, T>& c2 )
+{
+	return ((c1.r-c2.r)*(c1.r-c2.r)+(c1.g-c2.g)*(c1.g-c2.g)+(c1.b-c2.b)*(c1.b-c2.b));
+}
+
+template <typename T>
+inline T distance2( const ColorN<4, T>& c1, const ColorN<4, T>& c2 )
+{
+	return ((c1.v[0]-c2.v[0])*(c1.v[0]-c2.v[0])+(c1.v[1]-c2.v[1])*(c1.v[1]-c2.v[1])
+			+(c1.v[2]-c2.v[2])*(c1.v[2]-c2.v[2])+(c1.v[3]-c2.v[3])*(c1.v[3]-c2.v[3]));
+}
 
 }
 #endif //COLOR_H
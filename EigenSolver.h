@@ -0,0 +1,110 @@
+/*
+ * GrabCut implementation source code Copyright(c) 2005-2006 Justin Talbot
+ *
+ * All Rights Reserved.
+ * For educational use only; commercial use expressly forbidden.
+ * NO WARRANTY, express or implied, for this software.
+ */
+
+#ifndef EIGEN_SOLVER_H
+#define EIGEN_SOLVER_H
+
+#include "Global.h"
+
+namespace GrabCutNS {
+
+// Eigen decomposition of a symmetric NxN matrix by cyclic Jacobi rotations, carried out in double.
+// Eigenvalues are returned in decreasing order, with the matching unit eigenvectors as the columns of
+// eigenvectors (eigenvectors[i][k] is component i of the k-th vector), the same layout cvSVD gave us.
+// No allocation, so it can be used freely inside per-cluster or batch loops.
+template <unsigned int N, typename T>
+inline void symmetricEigen(const T matrix[N][N], T eigenvalues[N], T eigenvectors[N][N])
+{
+	double a[N][N], v[N][N];
+
+	for (int i = 0; i < (int)N; i++)
+	{
+		for (int j = 0; j < (int)N; j++)
+		{
+			a[i][j] = matrix[i][j];
+			v[i][j] = (i == j) ? 1.0 : 0.0;
+		}
+	}
+
+	// A handful of sweeps is plenty for the small matrices we have, the off diagonal norm converges
+	// quadratically
+	for (int sweep = 0; sweep < 16; sweep++)
+	{
+		double off = 0, diagonal = 0;
+		for (int p = 0; p < (int)N; p++)
+		{
+			diagonal += a[p][p]*a[p][p];
+			for (int q = p+1; q < (int)N; q++)
+				off += a[p][q]*a[p][q];
+		}
+		if (off <= 1e-30 * diagonal || off == 0)
+			break;
+
+		for (int p = 0; p < (int)N-1; p++)
+		{
+			for (int q = p+1; q < (int)N; q++)
+			{
+				if (a[p][q] == 0)
+					continue;
+
+				// Rotation that zeroes a[p][q]
+				double theta = (a[q][q] - a[p][p]) / (2*a[p][q]);
+				double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1));
+				double c = 1 / sqrt(t*t + 1);
+				double s = t*c;
+
+				for (int k = 0; k < (int)N; k++)
+				{
+					double akp = a[k][p], akq = a[k][q];
+					a[k][p] = c*akp - s*akq;
+					a[k][q] = s*akp + c*akq;
+				}
+
+				for (int k = 0; k < (int)N; k++)
+				{
+					double apk = a[p][k], aqk = a[q][k];
+					a[p][k] = c*apk - s*aqk;
+					a[q][k] = s*apk + c*aqk;
+				}
+
+				for (int k = 0; k < (int)N; k++)
+				{
+					double vkp = v[k][p], vkq = v[k][q];
+					v[k][p] = c*vkp - s*vkq;
+					v[k][q] = s*vkp + c*vkq;
+				}
+			}
+		}
+	}
+
+	// Sort by decreasing eigenvalue
+	int order[N];
+	for (int i = 0; i < (int)N; i++)
+		order[i] = i;
+
+	for (int i = 0; i < (int)N-1; i++)
+	{
+		for (int j = i+1; j < (int)N; j++)
+		{
+			if (a[order[j]][order[j]] > a[order[i]][order[i]])
+			{
+				int t = order[i]; order[i] = order[j]; order[j] = t;
+			}
+		}
+	}
+
+	for (int k = 0; k < (int)N; k++)
+	{
+		eigenvalues[k] = (T)a[order[k]][order[k]];
+		for (int i = 0; i < (int)N; i++)
+			eigenvectors[i][k] = (T)v[i][order[k]];
+	}
+}
+
+}
+#endif //EIGEN_SOLVER_H
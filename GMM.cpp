@@ -7,341 +7,2428 @@
  */
 
 #include "GMM.h"
-#include <cxcore.h>
+#include "EigenSolver.h"
+#include <algorithm>
 
 namespace GrabCutNS {
 
-GMM::GMM(unsigned int K) : m_K(K)
+template <unsigned int N, typename T>
+GMMN<N, T>::GMMN(unsigned int K, CovarianceModel model) : m_K(K), m_capacity(K), m_minK(K), m_covarianceModel(model)
 {
-	m_gaussians = new Gaussian[m_K];
+	m_gaussians = new GaussianN<N, T>[m_K];
 }
 
-GMM::~GMM()
+template <unsigned int N, typename T>
+GMMN<N, T>::~GMMN()
 {
 	if (m_gaussians)
 		delete [] m_gaussians;
 }
 
-Real GMM::p(Color c)
+template <unsigned int N, typename T>
+GMMN<N, T>::GMMN(const GMMN<N, T>& gmm) : m_K(gmm.m_K), m_capacity(gmm.m_capacity), m_minK(gmm.m_minK), m_covarianceModel(gmm.m_covarianceModel)
 {
-	Real result = 0;
+	m_gaussians = new GaussianN<N, T>[m_capacity];
+	for (unsigned int i = 0; i < m_K; i++)
+		m_gaussians[i] = gmm.m_gaussians[i];
+}
+
+template <unsigned int N, typename T>
+GMMN<N, T>& GMMN<N, T>::operator=(const GMMN<N, T>& gmm)
+{
+	if (this == &gmm)
+		return *this;
+
+	if (m_capacity != gmm.m_capacity)
+	{
+		delete [] m_gaussians;
+		m_capacity = gmm.m_capacity;
+		m_gaussians = new GaussianN<N, T>[m_capacity];
+	}
+
+	m_K = gmm.m_K;
+	m_minK = gmm.m_minK;
+	m_covarianceModel = gmm.m_covarianceModel;
+	for (unsigned int i = 0; i < m_K; i++)
+		m_gaussians[i] = gmm.m_gaussians[i];
+
+	return *this;
+}
+
+template <unsigned int N, typename T>
+T GMMN<N, T>::p(ColorN<N, T> c)
+{
+	T result = 0;
+
+	if (m_gaussians)
+	{
+		for (unsigned int i=0; i < m_K; i++)
+		{
+			result += m_gaussians[i].pi * p(i, c);
+		}
+	}
+
+	return result;
+}
+
+// Mahalanobis term d'*inverse*d of a color offset d, from the packed coefficients of the inverse
+template <unsigned int N, typename T>
+static inline T quadraticForm(const T* a, const T* d)
+{
+	T result = 0;
+
+	for (unsigned int k = 0; k < N; k++)
+		result += a[k]*d[k]*d[k];
+
+	unsigned int c = N;
+	for (unsigned int k = 0; k < N; k++)
+		for (unsigned int l = k+1; l < N; l++)
+			result += a[c++]*d[k]*d[l];
+
+	return result;
+}
+
+template <unsigned int N, typename T>
+T GMMN<N, T>::p(unsigned int i, ColorN<N, T> c)
+{
+	T result = 0;
+
+	if( m_gaussians[i].pi > 0 )
+	{
+		if (m_gaussians[i].determinant > 0)
+		{
+			T delta[N];
+			for (unsigned int k = 0; k < N; k++)
+				delta[k] = c[k] - m_gaussians[i].mu[k];
+
+			T d = quadraticForm<N>(m_gaussians[i].coef, delta);
+
+			result = m_gaussians[i].norm * exp(-(T)0.5*d);
+		}
+	}
+
+	return result;
+}
+
+// Batch evaluation helpers. Colors are processed in blocks of GMMBlockSize, deinterleaved into
+// channel arrays so that the per-Gaussian loops below are straight-line code over contiguous data.
+static const unsigned int GMMBlockSize = 64;
+
+// Log density used for Gaussians that are not part of the mixture (pi == 0 or singular).
+static const double LogZero = -1e30;
+
+// Single precision exp and log in the style of the Cephes library: range reduction through the
+// float exponent bits and a short polynomial, accurate to about one ulp. Unlike the libm calls these
+// have no branches or function calls in the loop body, so the compiler can vectorize them.
+union FloatBits { float f; int i; };
+
+static inline void expBlock(float* v, unsigned int n)
+{
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		// Below -87 the result is no longer a normal float, flush it to zero.
+		float x = v[j];
+		float underflow = x < (float)-87.0 ? (float)0 : (float)1;
+		x = x < (float)-87.0 ? (float)-87.0 : x;
+		x = x > (float)88.0 ? (float)88.0 : x;
+
+		// exp(x) = 2^k * exp(r), |r| <= ln(2)/2
+		float k = floor(x * (float)1.44269504088896341 + (float)0.5);
+		float r = x - k * (float)0.693359375 + k * (float)2.12194440e-4;
+		float z = r * r;
+
+		float y = ((((((float)1.9875691500E-4 * r + (float)1.3981999507E-3) * r + (float)8.3334519073E-3) * r
+				+ (float)4.1665795894E-2) * r + (float)1.6666665459E-1) * r + (float)5.0000001201E-1) * z + r + 1;
+
+		FloatBits scale;
+		scale.i = ((int)k + 127) << 23;
+
+		v[j] = underflow * y * scale.f;
+	}
+}
+
+static inline void negLogBlock(float* v, unsigned int n)
+{
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		// Clamp to the smallest normal float, so a zero density gives a large finite cost instead of inf.
+		FloatBits x;
+		x.f = v[j] < (float)1.17549435e-38 ? (float)1.17549435e-38 : v[j];
+
+		// log(x) = e*log(2) + log(m), m in [sqrt(1/2), sqrt(2))
+		float e = (float)(((x.i >> 23) & 0xff) - 126);
+		x.i = (x.i & 0x807fffff) | 0x3f000000;
+
+		float m = x.f;
+		float small = m < (float)0.707106781186547524 ? (float)1 : (float)0;
+		e -= small;
+		m = m + small * m - 1;
+
+		float z = m * m;
+		float y = (((((((((float)7.0376836292E-2 * m - (float)1.1514610310E-1) * m + (float)1.1676998740E-1) * m
+				- (float)1.2420140846E-1) * m + (float)1.4249322787E-1) * m - (float)1.6668057665E-1) * m
+				+ (float)2.0000714765E-1) * m - (float)2.4999993993E-1) * m + (float)3.3333331174E-1) * m * z;
+
+		y += e * (float)-2.12194440e-4 - (float)0.5 * z;
+
+		v[j] = -(m + y + e * (float)0.693359375);
+	}
+}
+
+// In double precision the libm functions are used. As above, a zero density is clamped to the smallest
+// normal value.
+static inline void expBlock(double* v, unsigned int n)
+{
+	for (unsigned int j = 0; j < n; ++j)
+		v[j] = exp(v[j]);
+}
+
+static inline void negLogBlock(double* v, unsigned int n)
+{
+	for (unsigned int j = 0; j < n; ++j)
+		v[j] = -log(v[j] < 2.2250738585072014e-308 ? 2.2250738585072014e-308 : v[j]);
+}
+
+// Quadratic forms of a Gaussian for color j of a planar block, whose channel k is at
+// channels[k*stride + j]: the squared distance to the mean, the same weighted by the diagonal
+// coefficients, and the full Mahalanobis term. The channel counts in use are specialized below into
+// straight-line code; the compiler does not reliably unroll the generic loops by itself.
+template <unsigned int N, typename T>
+struct BlockForm
+{
+	static inline T spherical(const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T sum = 0;
+		for (unsigned int k = 0; k < N; k++)
+		{
+			T d = channels[k*stride + j] - mu[k];
+			sum += d*d;
+		}
+		return sum;
+	}
+
+	static inline T diagonal(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T sum = 0;
+		for (unsigned int k = 0; k < N; k++)
+		{
+			T d = channels[k*stride + j] - mu[k];
+			sum += a[k]*d*d;
+		}
+		return sum;
+	}
+
+	static inline T full(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T d[N];
+		for (unsigned int k = 0; k < N; k++)
+			d[k] = channels[k*stride + j] - mu[k];
+		return quadraticForm<N>(a, d);
+	}
+};
+
+template <typename T>
+struct BlockForm<1, T>
+{
+	static inline T spherical(const T* mu, const T* channels, unsigned int /*stride*/, unsigned int j)
+	{
+		T d = channels[j] - mu[0];
+		return d*d;
+	}
+
+	static inline T diagonal(const T* a, const T* mu, const T* channels, unsigned int /*stride*/, unsigned int j)
+	{
+		T d = channels[j] - mu[0];
+		return a[0]*d*d;
+	}
+
+	static inline T full(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		return diagonal(a, mu, channels, stride, j);
+	}
+};
+
+template <typename T>
+struct BlockForm<3, T>
+{
+	static inline T spherical(const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T dr = channels[j] - mu[0];
+		T dg = channels[stride + j] - mu[1];
+		T db = channels[2*stride + j] - mu[2];
+
+		return dr*dr + dg*dg + db*db;
+	}
+
+	static inline T diagonal(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T dr = channels[j] - mu[0];
+		T dg = channels[stride + j] - mu[1];
+		T db = channels[2*stride + j] - mu[2];
+
+		return a[0]*dr*dr + a[1]*dg*dg + a[2]*db*db;
+	}
+
+	static inline T full(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T dr = channels[j] - mu[0];
+		T dg = channels[stride + j] - mu[1];
+		T db = channels[2*stride + j] - mu[2];
+
+		return a[0]*dr*dr + a[1]*dg*dg + a[2]*db*db + a[3]*dr*dg + a[4]*dr*db + a[5]*dg*db;
+	}
+};
+
+template <typename T>
+struct BlockForm<4, T>
+{
+	static inline T spherical(const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T d0 = channels[j] - mu[0];
+		T d1 = channels[stride + j] - mu[1];
+		T d2 = channels[2*stride + j] - mu[2];
+		T d3 = channels[3*stride + j] - mu[3];
+
+		return d0*d0 + d1*d1 + d2*d2 + d3*d3;
+	}
+
+	static inline T diagonal(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T d0 = channels[j] - mu[0];
+		T d1 = channels[stride + j] - mu[1];
+		T d2 = channels[2*stride + j] - mu[2];
+		T d3 = channels[3*stride + j] - mu[3];
+
+		return a[0]*d0*d0 + a[1]*d1*d1 + a[2]*d2*d2 + a[3]*d3*d3;
+	}
+
+	static inline T full(const T* a, const T* mu, const T* channels, unsigned int stride, unsigned int j)
+	{
+		T d0 = channels[j] - mu[0];
+		T d1 = channels[stride + j] - mu[1];
+		T d2 = channels[2*stride + j] - mu[2];
+		T d3 = channels[3*stride + j] - mu[3];
+
+		return a[0]*d0*d0 + a[1]*d1*d1 + a[2]*d2*d2 + a[3]*d3*d3
+			   + a[4]*d0*d1 + a[5]*d0*d2 + a[6]*d0*d3 + a[7]*d1*d2 + a[8]*d1*d3 + a[9]*d2*d3;
+	}
+};
+
+// Log densities of one Gaussian for a planar block of colors, channel k starting at channels + k*stride. The quadratic form is specialized
+// per covariance model, diagonal and spherical Gaussians skip the cross terms.
+template <unsigned int N, typename T>
+static inline void logDensityBlock(const GaussianN<N, T>& g, CovarianceModel model, const T* channels, unsigned int stride, unsigned int n, T* out)
+{
+	if (g.pi <= 0 || g.determinant <= 0)
+	{
+		for (unsigned int j = 0; j < n; ++j)
+			out[j] = LogZero;
+		return;
+	}
+
+	const T* a = g.coef;
+	const T logNorm = g.logNorm;
+
+	T mu[N];
+	for (unsigned int k = 0; k < N; k++)
+		mu[k] = g.mu[k];
+
+	switch (model)
+	{
+	case CovarianceSpherical:
+		for (unsigned int j = 0; j < n; ++j)
+			out[j] = logNorm - (T)0.5 * a[0] * BlockForm<N, T>::spherical(mu, channels, stride, j);
+		break;
+
+	case CovarianceDiagonal:
+		for (unsigned int j = 0; j < n; ++j)
+			out[j] = logNorm - (T)0.5 * BlockForm<N, T>::diagonal(a, mu, channels, stride, j);
+		break;
+
+	default:
+		for (unsigned int j = 0; j < n; ++j)
+			out[j] = logNorm - (T)0.5 * BlockForm<N, T>::full(a, mu, channels, stride, j);
+		break;
+	}
+}
+
+// Split a block of colors into channel arrays of GMMBlockSize
+template <unsigned int N, typename T>
+static inline void deinterleave(const ColorN<N, T>* colors, unsigned int n, T* channels)
+{
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		for (unsigned int k = 0; k < N; k++)
+			channels[k*GMMBlockSize + j] = colors[j][k];
+	}
+}
+
+template <typename T>
+static inline void deinterleave(const ColorN<1, T>* colors, unsigned int n, T* channels)
+{
+	for (unsigned int j = 0; j < n; ++j)
+		channels[j] = colors[j].v;
+}
+
+template <typename T>
+static inline void deinterleave(const ColorN<3, T>* colors, unsigned int n, T* channels)
+{
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		channels[j] = colors[j].r;
+		channels[GMMBlockSize + j] = colors[j].g;
+		channels[2*GMMBlockSize + j] = colors[j].b;
+	}
+}
+
+template <typename T>
+static inline void deinterleave(const ColorN<4, T>* colors, unsigned int n, T* channels)
+{
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		channels[j] = colors[j].v[0];
+		channels[GMMBlockSize + j] = colors[j].v[1];
+		channels[2*GMMBlockSize + j] = colors[j].v[2];
+		channels[3*GMMBlockSize + j] = colors[j].v[3];
+	}
+}
+
+template <unsigned int N, typename T>
+void GMMN<N, T>::componentDensities(const ColorN<N, T>* colors, unsigned int n, T* planes, bool logDomain) const
+{
+	T channels[N*GMMBlockSize];
+
+	for (unsigned int start = 0; start < n; start += GMMBlockSize)
+	{
+		unsigned int count = n - start < GMMBlockSize ? n - start : GMMBlockSize;
+
+		deinterleave(colors + start, count, channels);
+
+		for (unsigned int i = 0; i < m_K; i++)
+		{
+			T* out = planes + i*n + start;
+
+			logDensityBlock(m_gaussians[i], m_covarianceModel, channels, GMMBlockSize, count, out);
+
+			if (!logDomain)
+				expBlock(out, count);
+		}
+	}
+}
+
+template <unsigned int N, typename T>
+void GMMN<N, T>::p(const ColorN<N, T>* colors, unsigned int n, T* result, bool negLog) const
+{
+	T channels[N*GMMBlockSize], density[GMMBlockSize];
+
+	for (unsigned int start = 0; start < n; start += GMMBlockSize)
+	{
+		unsigned int count = n - start < GMMBlockSize ? n - start : GMMBlockSize;
+		T* out = result + start;
+
+		deinterleave(colors + start, count, channels);
+
+		for (unsigned int j = 0; j < count; ++j)
+			out[j] = 0;
+
+		for (unsigned int i = 0; i < m_K; i++)
+		{
+			if (m_gaussians[i].pi <= 0 || m_gaussians[i].determinant <= 0)
+				continue;
+
+			logDensityBlock(m_gaussians[i], m_covarianceModel, channels, GMMBlockSize, count, density);
+			expBlock(density, count);
+
+			const T pi = m_gaussians[i].pi;
+			for (unsigned int j = 0; j < count; ++j)
+				out[j] += pi * density[j];
+		}
+
+		if (negLog)
+			negLogBlock(out, count);
+	}
+}
+
+template <unsigned int N, typename T>
+void componentDensities(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const ColorN<N, T>* colors, unsigned int n,
+						T* backPlanes, T* forePlanes, bool logDomain)
+{
+	T channels[N*GMMBlockSize];
+
+	// Deinterleave each block once and run it through the components of both models
+	for (unsigned int start = 0; start < n; start += GMMBlockSize)
+	{
+		unsigned int count = n - start < GMMBlockSize ? n - start : GMMBlockSize;
+
+		deinterleave(colors + start, count, channels);
+
+		for (unsigned int i = 0; i < backgroundGMM.K(); i++)
+		{
+			T* out = backPlanes + i*n + start;
+			logDensityBlock(backgroundGMM.m_gaussians[i], backgroundGMM.covarianceModel(), channels, GMMBlockSize, count, out);
+			if (!logDomain)
+				expBlock(out, count);
+		}
+
+		for (unsigned int i = 0; i < foregroundGMM.K(); i++)
+		{
+			T* out = forePlanes + i*n + start;
+			logDensityBlock(foregroundGMM.m_gaussians[i], foregroundGMM.covarianceModel(), channels, GMMBlockSize, count, out);
+			if (!logDomain)
+				expBlock(out, count);
+		}
+	}
+}
+
+// Most likely component of one model and its -log p for a block, from the per-component log densities
+template <unsigned int N, typename T>
+static inline void assignAndScore(const GMMN<N, T>& gmm, const GaussianN<N, T>* gaussians, const T* channels, unsigned int stride, unsigned int count,
+								  T* logDensities, unsigned int* component, T* cost)
+{
+	T best[GMMBlockSize], bestWeighted[GMMBlockSize], sum[GMMBlockSize];
+
+	for (unsigned int j = 0; j < count; ++j)
+	{
+		best[j] = LogZero;
+		bestWeighted[j] = LogZero;
+		if (component)
+			component[j] = 0;
+	}
+
+	for (unsigned int i = 0; i < gmm.K(); i++)
+	{
+		T* l = logDensities + i*GMMBlockSize;
+		logDensityBlock(gaussians[i], gmm.covarianceModel(), channels, stride, count, l);
+
+		const T logPi = gaussians[i].logPi;
+		for (unsigned int j = 0; j < count; ++j)
+		{
+			if (l[j] > best[j])
+			{
+				best[j] = l[j];
+				if (component)
+					component[j] = i;
+			}
+
+			T weighted = l[j] + logPi;
+			bestWeighted[j] = weighted > bestWeighted[j] ? weighted : bestWeighted[j];
+		}
+	}
+
+	if (!cost)
+		return;
+
+	// -log sum_i pi_i p_i(c) = -(m + log sum_i exp(log pi_i + log p_i(c) - m)), m the largest term
+	for (unsigned int j = 0; j < count; ++j)
+		sum[j] = 0;
+
+	for (unsigned int i = 0; i < gmm.K(); i++)
+	{
+		if (gaussians[i].pi <= 0 || gaussians[i].determinant <= 0)
+			continue;
+
+		T* l = logDensities + i*GMMBlockSize;
+		const T logPi = gaussians[i].logPi;
+		for (unsigned int j = 0; j < count; ++j)
+			l[j] += logPi - bestWeighted[j];
+
+		expBlock(l, count);
+
+		for (unsigned int j = 0; j < count; ++j)
+			sum[j] += l[j];
+	}
+
+	negLogBlock(sum, count);
+
+	for (unsigned int j = 0; j < count; ++j)
+		cost[j] = sum[j] - bestWeighted[j];
+}
+
+template <unsigned int N, typename T>
+void evaluateGMMs(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const ColorN<N, T>* colors, unsigned int n,
+				  unsigned int* backComponent, unsigned int* foreComponent, T* backCost, T* foreCost)
+{
+	T channels[N*GMMBlockSize];
+
+	unsigned int maxK = backgroundGMM.K() > foregroundGMM.K() ? backgroundGMM.K() : foregroundGMM.K();
+	std::vector<T> logDensities(maxK*GMMBlockSize);
+
+	bool back = backComponent || backCost;
+	bool fore = foreComponent || foreCost;
+
+	for (unsigned int start = 0; start < n; start += GMMBlockSize)
+	{
+		unsigned int count = n - start < GMMBlockSize ? n - start : GMMBlockSize;
+
+		deinterleave(colors + start, count, channels);
+
+		if (back)
+			assignAndScore(backgroundGMM, backgroundGMM.m_gaussians, channels, GMMBlockSize, count, &logDensities[0],
+						   backComponent ? backComponent + start : 0, backCost ? backCost + start : 0);
+		if (fore)
+			assignAndScore(foregroundGMM, foregroundGMM.m_gaussians, channels, GMMBlockSize, count, &logDensities[0],
+						   foreComponent ? foreComponent + start : 0, foreCost ? foreCost + start : 0);
+	}
+}
+
+template <unsigned int N, typename T>
+void evaluateGMMs(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const T* channels, unsigned int channelStride,
+				  unsigned int n, unsigned int* backComponent, unsigned int* foreComponent, T* backCost, T* foreCost)
+{
+	unsigned int maxK = backgroundGMM.K() > foregroundGMM.K() ? backgroundGMM.K() : foregroundGMM.K();
+	std::vector<T> logDensities(maxK*GMMBlockSize);
+
+	bool back = backComponent || backCost;
+	bool fore = foreComponent || foreCost;
+
+	// Already planar, the blocks are read in place
+	for (unsigned int start = 0; start < n; start += GMMBlockSize)
+	{
+		unsigned int count = n - start < GMMBlockSize ? n - start : GMMBlockSize;
+
+		if (back)
+			assignAndScore(backgroundGMM, backgroundGMM.m_gaussians, channels + start, channelStride, count, &logDensities[0],
+						   backComponent ? backComponent + start : 0, backCost ? backCost + start : 0);
+		if (fore)
+			assignAndScore(foregroundGMM, foregroundGMM.m_gaussians, channels + start, channelStride, count, &logDensities[0],
+						   foreComponent ? foreComponent + start : 0, foreCost ? foreCost + start : 0);
+	}
+}
+
+// Determinant and inverse of a covariance matrix. The general case runs Gauss-Jordan elimination with
+// partial pivoting in double; the channel counts in use have closed forms.
+template <unsigned int N, typename T>
+static void invertCovariance(const T covariance[N][N], T inverse[N][N], T& determinant)
+{
+	double a[N][2*N];
+
+	for (unsigned int i = 0; i < N; i++)
+	{
+		for (unsigned int j = 0; j < N; j++)
+		{
+			a[i][j] = covariance[i][j];
+			a[i][N+j] = i == j ? 1.0 : 0.0;
+		}
+	}
+
+	double det = 1;
+
+	for (unsigned int c = 0; c < N; c++)
+	{
+		unsigned int pivot = c;
+		for (unsigned int i = c+1; i < N; i++)
+		{
+			if (fabs(a[i][c]) > fabs(a[pivot][c]))
+				pivot = i;
+		}
+
+		if (a[pivot][c] == 0)
+		{
+			determinant = 0;
+			return;
+		}
+
+		if (pivot != c)
+		{
+			for (unsigned int j = 0; j < 2*N; j++)
+				std::swap(a[c][j], a[pivot][j]);
+			det = -det;
+		}
+
+		det *= a[c][c];
+
+		const double scale = 1 / a[c][c];
+		for (unsigned int j = 0; j < 2*N; j++)
+			a[c][j] *= scale;
+
+		for (unsigned int i = 0; i < N; i++)
+		{
+			if (i == c || a[i][c] == 0)
+				continue;
+
+			const double f = a[i][c];
+			for (unsigned int j = 0; j < 2*N; j++)
+				a[i][j] -= f * a[c][j];
+		}
+	}
+
+	determinant = (T)det;
+	for (unsigned int i = 0; i < N; i++)
+		for (unsigned int j = 0; j < N; j++)
+			inverse[i][j] = (T)a[i][N+j];
+}
+
+template <typename T>
+static void invertCovariance(const T covariance[1][1], T inverse[1][1], T& determinant)
+{
+	determinant = covariance[0][0];
+	inverse[0][0] = 1 / determinant;
+}
+
+template <typename T>
+static void invertCovariance(const T covariance[3][3], T inverse[3][3], T& determinant)
+{
+	// Compute determinant of covariance matrix
+	determinant = covariance[0][0]*(covariance[1][1]*covariance[2][2]-covariance[1][2]*covariance[2][1])
+				  - covariance[0][1]*(covariance[1][0]*covariance[2][2]-covariance[1][2]*covariance[2][0])
+				  + covariance[0][2]*(covariance[1][0]*covariance[2][1]-covariance[1][1]*covariance[2][0]);
+
+	// Compute inverse (cofactor matrix divided by determinant)
+	inverse[0][0] =  (covariance[1][1]*covariance[2][2] - covariance[1][2]*covariance[2][1]) / determinant;
+	inverse[1][0] = -(covariance[1][0]*covariance[2][2] - covariance[1][2]*covariance[2][0]) / determinant;
+	inverse[2][0] =  (covariance[1][0]*covariance[2][1] - covariance[1][1]*covariance[2][0]) / determinant;
+	inverse[0][1] = -(covariance[0][1]*covariance[2][2] - covariance[0][2]*covariance[2][1]) / determinant;
+	inverse[1][1] =  (covariance[0][0]*covariance[2][2] - covariance[0][2]*covariance[2][0]) / determinant;
+	inverse[2][1] = -(covariance[0][0]*covariance[2][1] - covariance[0][1]*covariance[2][0]) / determinant;
+	inverse[0][2] =  (covariance[0][1]*covariance[1][2] - covariance[0][2]*covariance[1][1]) / determinant;
+	inverse[1][2] = -(covariance[0][0]*covariance[1][2] - covariance[0][2]*covariance[1][0]) / determinant;
+	inverse[2][2] =  (covariance[0][0]*covariance[1][1] - covariance[0][1]*covariance[1][0]) / determinant;
+}
+
+// Determinant, inverse and evaluation constants of a Gaussian from its covariance
+template <unsigned int N, typename T>
+static void computeInverse(GaussianN<N, T>& g)
+{
+	invertCovariance(g.covariance, g.inverse, g.determinant);
+
+	// Constants for evaluation: normalization and the distinct coefficients of the symmetric inverse,
+	// the diagonal first and then the doubled entries above it
+	g.norm = (T)(1.0/sqrt(g.determinant));
+	g.logNorm = (T)(-0.5*log(g.determinant));
+
+	for (unsigned int i = 0; i < N; i++)
+		g.coef[i] = g.inverse[i][i];
+
+	unsigned int c = N;
+	for (unsigned int i = 0; i < N; i++)
+		for (unsigned int j = i+1; j < N; j++)
+			g.coef[c++] = g.inverse[i][j] + g.inverse[j][i];
+}
+
+// Replace the covariances of the K gaussians by their pooled (pi weighted) covariance
+template <unsigned int N, typename T>
+static void tieCovariances(GaussianN<N, T>* gaussians, unsigned int K)
+{
+	T pooled[N][N];
+	for (unsigned int i = 0; i < N; i++)
+		for (unsigned int j = 0; j < N; j++)
+			pooled[i][j] = 0;
+
+	for (unsigned int k = 0; k < K; k++)
+	{
+		if (gaussians[k].pi <= 0)
+			continue;
+
+		for (unsigned int i = 0; i < N; i++)
+			for (unsigned int j = 0; j < N; j++)
+				pooled[i][j] += gaussians[k].pi * gaussians[k].covariance[i][j];
+	}
+
+	for (unsigned int k = 0; k < K; k++)
+	{
+		if (gaussians[k].pi <= 0)
+			continue;
+
+		for (unsigned int i = 0; i < N; i++)
+			for (unsigned int j = 0; j < N; j++)
+				gaussians[k].covariance[i][j] = pooled[i][j];
+
+		computeInverse(gaussians[k]);
+	}
+}
+
+
+// Model selection by the Bayesian information criterion, BIC = -2 log L + (free parameters) log N.
+// The log-likelihood of the samples of a component under the Gaussian fit to them has a closed form:
+// for a maximum likelihood fit the Mahalanobis terms sum to the dimension per sample. Constant terms
+// are left out, all candidates are compared on the same samples.
+template <unsigned int N, typename T>
+static double componentLogLikelihood(const GaussianFitterN<N, T>& fitter, unsigned int totalCount, CovarianceModel model)
+{
+	if (fitter.samples() == 0)
+		return 0;
+
+	// Tied components are judged as separate full Gaussians
+	GaussianN<N, T> g;
+	fitter.finalize(g, totalCount, false, model == CovarianceTied ? CovarianceFull : model);
+
+	double n = fitter.samples();
+	return n * (log(n/totalCount) - 0.5*log((double)g.determinant) - 0.5*N);
+}
+
+// Parameters a component adds: its mean, covariance and weight
+template <unsigned int N>
+static double componentPenalty(CovarianceModel model, unsigned int totalCount)
+{
+	int parameters = model == CovarianceSpherical ? N+2 : (model == CovarianceDiagonal ? 2*N+1 : N + N*(N+1)/2 + 1);
+	return 0.5 * parameters * log((double)(totalCount > 1 ? totalCount : 1));
+}
+
+// Whole-image passes are split into bands of BandRows rows that run in parallel. Each band accumulates
+// into its own GaussianFitters, which are merged in band order afterwards, so the sums come out the same
+// whatever the number of threads or their scheduling.
+static const int BandRows = 16;
+
+static inline int bandCount(unsigned int height)
+{
+	return (height + BandRows - 1) / BandRows;
+}
+
+// Projection of a color on a direction
+template <unsigned int N, typename T>
+static inline T dot(const T (&e)[N], const ColorN<N, T>& c)
+{
+	T result = 0;
+	for (unsigned int k = 0; k < N; k++)
+		result += e[k] * c[k];
+	return result;
+}
+
+// Orchard-Bouman clustering of one model. Its colors are kept in one array, partitioned so that every
+// cluster is a contiguous range, with the pixel index of each color alongside. Splitting a cluster
+// only walks (and partitions) that cluster's range instead of the whole image.
+// With minK below K, every split level is scored by BIC as it is reached (the splits are nested),
+// and the splits beyond the best level are undone afterwards; K returns the chosen level.
+template <unsigned int N, typename T>
+static void buildGMM(GaussianN<N, T>* gaussians, unsigned int minK, unsigned int& K, CovarianceModel model, std::vector<ColorN<N, T> >& colors, std::vector<unsigned int>& pixels, Image<unsigned char>& components)
+{
+	const unsigned int total = (unsigned int)colors.size();
+
+	std::vector<unsigned int> begin(K, 0), end(K, 0), parent(K, 0);
+	end[0] = total;
+
+	// Initialize the first cluster
+	std::vector<GaussianFitterN<N, T> > fitters(K);
+	for (unsigned int j = 0; j < total; ++j)
+		fitters[0].add(colors[j]);
+
+	fitters[0].finalize(gaussians[0], total, true, model);
+
+	// Half the BIC of the current level, and the best level so far
+	const bool select = minK < K;
+	const double penalty = componentPenalty<N>(model, total);
+	double logLikelihood = select ? componentLogLikelihood(fitters[0], total, model) : 0;
+	double bestScore = penalty - logLikelihood;
+	unsigned int bestK = 1;
+
+	unsigned int n = 0;		// Which cluster will be split
+
+	// Compute clusters
+	for (unsigned int i = 1; i < K; i++)
+	{
+		// For brevity, get a reference to the splitting Gaussian
+		const GaussianN<N, T>& g = gaussians[n];
+
+		// Compute splitting point
+		T e[N];
+		for (unsigned int k = 0; k < N; k++)
+			e[k] = g.eigenvectors[k][0];
+
+		const T split = dot(e, g.mu);
+
+		// Split cluster n: colors beyond the split plane are swapped to the end of its range,
+		// which becomes cluster i
+		GaussianFitterN<N, T> stay, move;
+		unsigned int lo = begin[n], hi = end[n];
+
+		while (lo < hi)
+		{
+			ColorN<N, T> c = colors[lo];
+
+			if (dot(e, c) > split)
+			{
+				--hi;
+				std::swap(colors[lo], colors[hi]);
+				std::swap(pixels[lo], pixels[hi]);
+				move.add(c);
+			}
+			else
+			{
+				stay.add(c);
+				++lo;
+			}
+		}
+
+		begin[i] = lo;
+		end[i] = end[n];
+		end[n] = lo;
+		parent[i] = n;
+
+		if (select)
+		{
+			logLikelihood += componentLogLikelihood(stay, total, model) + componentLogLikelihood(move, total, model)
+							 - componentLogLikelihood(fitters[n], total, model);
+
+			double score = (i+1)*penalty - logLikelihood;
+			if (i+1 <= minK || score < bestScore)
+			{
+				bestScore = score;
+				bestK = i+1;
+			}
+		}
+
+		fitters[n] = stay;
+		fitters[i] = move;
+
+		// Compute new split Gaussians
+		stay.finalize(gaussians[n], total, true, model);
+		move.finalize(gaussians[i], total, true, model);
+
+		// Find cluster with highest eigenvalue
+		n = 0;
+		for (unsigned int j = 0; j <= i; j++)
+		{
+			if (gaussians[j].eigenvalues[0] > gaussians[n].eigenvalues[0])
+				n = j;
+		}
+	}
+
+	// Undo the splits beyond the chosen level, last first, so that each cluster's range is adjacent to
+	// its parent's again
+	if (select && bestK < K)
+	{
+		for (unsigned int i = K-1; i >= bestK; i--)
+		{
+			fitters[parent[i]].add(fitters[i]);
+			end[parent[i]] = end[i];
+		}
+
+		K = bestK;
+		for (unsigned int i = 0; i < K; i++)
+			fitters[i].finalize(gaussians[i], total, false, model);
+	}
+
+	// Tied clusters were split on their own covariances, share them only now
+	if (model == CovarianceTied)
+		tieCovariances(gaussians, K);
+
+	unsigned char* component = components.ptr();
+	for (unsigned int i = 0; i < K; i++)
+	{
+		for (unsigned int j = begin[i]; j < end[i]; ++j)
+			component[pixels[j]] = (unsigned char)i;
+	}
+}
+
+// Histogram initialization: each channel is quantized to Levels levels, and every bin keeps the sums of
+// the colors that fall into it. The bits per channel shrink with the channel count, so that there are
+// about 2^12 bins for any N. The image is histogrammed in HistogramChunks row ranges in parallel, merged
+// in chunk order so that the sums do not depend on the threads.
+template <unsigned int N>
+struct Histogram
+{
+	enum { Bits = 12/N, Levels = 1 << Bits, Bins = 1 << (Bits*N) };
+};
+
+static const int HistogramChunks = 8;
+static const int LloydIterations = 10;
+
+template <unsigned int N, typename T>
+static inline unsigned int histogramBin(const ColorN<N, T>& c)
+{
+	unsigned int bin = 0;
+
+	for (unsigned int k = 0; k < N; k++)
+	{
+		int q = (int)(c[k] * Histogram<N>::Levels);
+		q = q < 0 ? 0 : (q >= (int)Histogram<N>::Levels ? Histogram<N>::Levels-1 : q);
+		bin = (bin << Histogram<N>::Bits) | q;
+	}
+
+	return bin;
+}
+
+// Weighted k-means over the non-empty bins of one model, each represented by the mean of its colors and
+// weighted by its count. The Gaussians are finalized from the merged bin sums of each cluster, so they
+// are fit to the exact pixel colors, and binComponent receives the cluster of every used bin. Returns
+// the log-likelihood of the clustering, see componentLogLikelihood.
+template <unsigned int N, typename T>
+static double clusterHistogram(GaussianN<N, T>* gaussians, unsigned int K, CovarianceModel model, const std::vector<GaussianFitterN<N, T> >& bins, std::vector<unsigned int>& binComponent)
+{
+	std::vector<unsigned int> used;
+	std::vector<ColorN<N, T> > means;
+	std::vector<T> weights;
+	unsigned int total = 0;
+
+	for (unsigned int b = 0; b < bins.size(); ++b)
+	{
+		if (bins[b].samples())
+		{
+			used.push_back(b);
+			means.push_back(bins[b].mean());
+			weights.push_back((T)bins[b].samples());
+			total += bins[b].samples();
+		}
+	}
+
+	const unsigned int n = (unsigned int)used.size();
+	std::vector<ColorN<N, T> > centers;
+	std::vector<T> nearest(n);
+	std::vector<unsigned int> label(n, 0);
+
+	// k-means++ seeding. The first center is the heaviest bin, each next one a bin drawn with probability
+	// proportional to its weight times its squared distance to the nearest center. The generator has a
+	// fixed seed, so that the initialization is reproducible.
+	if (n)
+	{
+		unsigned int first = (unsigned int)(std::max_element(weights.begin(), weights.end()) - weights.begin());
+		centers.push_back(means[first]);
+
+		for (unsigned int j = 0; j < n; ++j)
+			nearest[j] = distance2(means[j], centers[0]);
+	}
+
+	unsigned int seed = 12345;
+
+	while (centers.size() < K)
+	{
+		double sum = 0;
+		for (unsigned int j = 0; j < n; ++j)
+			sum += weights[j] * nearest[j];
+
+		// Fewer distinct colors than components, the others stay empty
+		if (sum <= 0)
+			break;
+
+		seed = seed * 1103515245u + 12345u;
+		double target = sum * ((seed >> 8) / 16777216.0);
+
+		unsigned int pick = 0;
+		for (double acc = 0; pick < n-1; ++pick)
+		{
+			acc += weights[pick] * nearest[pick];
+			if (acc > target)
+				break;
+		}
+
+		centers.push_back(means[pick]);
+
+		for (unsigned int j = 0; j < n; ++j)
+		{
+			T d = distance2(means[j], centers.back());
+			if (d < nearest[j])
+				nearest[j] = d;
+		}
+	}
+
+	// Lloyd iterations, until no bin changes cluster
+	std::vector<GaussianFitterN<N, T> > clusters;
+
+	for (int iteration = 0; iteration < LloydIterations; ++iteration)
+	{
+		bool changed = false;
+
+		for (unsigned int j = 0; j < n; ++j)
+		{
+			unsigned int k = 0;
+			T min = distance2(means[j], centers[0]);
+
+			for (unsigned int i = 1; i < centers.size(); ++i)
+			{
+				T d = distance2(means[j], centers[i]);
+				if (d < min)
+				{
+					k = i;
+					min = d;
+				}
+			}
+
+			if (k != label[j])
+			{
+				label[j] = k;
+				changed = true;
+			}
+		}
+
+		clusters.assign(K, GaussianFitterN<N, T>());
+		for (unsigned int j = 0; j < n; ++j)
+			clusters[label[j]].add(bins[used[j]]);
+
+		if (!changed && iteration > 0)
+			break;
+
+		for (unsigned int i = 0; i < centers.size(); ++i)
+		{
+			if (clusters[i].samples())
+				centers[i] = clusters[i].mean();
+		}
+	}
+
+	double logLikelihood = 0;
+
+	clusters.resize(K);
+	for (unsigned int i = 0; i < K; i++)
+	{
+		clusters[i].finalize(gaussians[i], total, false, model);
+		logLikelihood += componentLogLikelihood(clusters[i], total, model);
+	}
+
+	if (model == CovarianceTied)
+		tieCovariances(gaussians, K);
+
+	for (unsigned int j = 0; j < n; ++j)
+		binComponent[used[j]] = label[j];
+
+	return logLikelihood;
+}
+
+// Cluster the histogram of one model with each K from minK up to the given K, and keep the one with
+// the lowest BIC. The clusterings are cheap, they run over bins and not pixels. The bins may be any
+// groups of colors, such as the superpixels of buildGMMs over groups.
+template <unsigned int N, typename T>
+static void selectHistogramClusters(GaussianN<N, T>* gaussians, unsigned int minK, unsigned int& K, CovarianceModel model, const std::vector<GaussianFitterN<N, T> >& bins, std::vector<unsigned int>& binComponent)
+{
+	if (minK >= K)
+	{
+		clusterHistogram(gaussians, K, model, bins, binComponent);
+		return;
+	}
+
+	unsigned int total = 0;
+	for (unsigned int b = 0; b < bins.size(); ++b)
+		total += bins[b].samples();
+
+	const double penalty = componentPenalty<N>(model, total);
+	std::vector<GaussianN<N, T> > trial(K);
+	std::vector<unsigned int> trialComponent(bins.size(), 0);
+	double bestScore = 0;
+	unsigned int bestK = 0;
+
+	for (unsigned int k = minK; k <= K; k++)
+	{
+		double score = k*penalty - clusterHistogram(&trial[0], k, model, bins, trialComponent);
+
+		if (bestK == 0 || score < bestScore)
+		{
+			bestScore = score;
+			bestK = k;
+			std::copy(trial.begin(), trial.begin() + k, gaussians);
+			binComponent.swap(trialComponent);
+		}
+	}
+
+	K = bestK;
+}
+
+// Histogram the colors of each segment (the sampled ones only, with a sampler)
+template <unsigned int N, typename T, typename S>
+static void buildColorHistograms(const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation, const FitSampler* sampler,
+								 std::vector<GaussianFitterN<N, T> >& backBins, std::vector<GaussianFitterN<N, T> >& foreBins)
+{
+	std::vector< std::vector<GaussianFitterN<N, T> > > foreChunks(HistogramChunks), backChunks(HistogramChunks);
+	const unsigned int chunkRows = (image.height() + HistogramChunks - 1) / HistogramChunks;
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int chunk = 0; chunk < HistogramChunks; ++chunk)
+	{
+		foreChunks[chunk].resize(Histogram<N>::Bins);
+		backChunks[chunk].resize(Histogram<N>::Bins);
+
+		unsigned int yEnd = (chunk+1)*chunkRows < image.height() ? (chunk+1)*chunkRows : image.height();
+
+		for (unsigned int y = chunk*chunkRows; y < yEnd; ++y)
+		{
+			const ColorN<N, S>* colors = image.row(y);
+			const BitWord* segmentation = hardSegmentation.row(y);
+
+			for (unsigned int x = 0; x < image.width(); ++x)
+			{
+				SegmentationValue segment = segmentationValue(segmentation, x);
+				if (sampler && !sampler->isSample(x, y, segment))
+					continue;
+
+				ColorN<N, T> c = toColor<T>(colors[x]);
+
+				if (segment == SegmentationForeground)
+					foreChunks[chunk][histogramBin(c)].add(c);
+				else
+					backChunks[chunk][histogramBin(c)].add(c);
+			}
+		}
+	}
+
+	foreBins.swap(foreChunks[0]);
+	backBins.swap(backChunks[0]);
+
+	for (int chunk = 1; chunk < HistogramChunks; ++chunk)
+	{
+		for (unsigned int b = 0; b < Histogram<N>::Bins; ++b)
+		{
+			foreBins[b].add(foreChunks[chunk][b]);
+			backBins[b].add(backChunks[chunk][b]);
+		}
+	}
+}
+
+template <unsigned int N, typename T, typename S>
+void buildGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation,
+			   const FitSampler* sampler, GMMInitialization initialization)
+{
+	// Start from the full capacity, the clustering picks K again if it is adaptive
+	backgroundGMM.m_K = backgroundGMM.m_capacity;
+	foregroundGMM.m_K = foregroundGMM.m_capacity;
+
+	if (initialization == InitHistogramKMeans)
+	{
+		std::vector<GaussianFitterN<N, T> > backBins, foreBins;
+		buildColorHistograms(image, hardSegmentation, sampler, backBins, foreBins);
+
+		std::vector<unsigned int> backComponent(Histogram<N>::Bins, 0), foreComponent(Histogram<N>::Bins, 0);
+
+		#pragma omp parallel sections
+		{
+			#pragma omp section
+			selectHistogramClusters(backgroundGMM.m_gaussians, backgroundGMM.m_minK, backgroundGMM.m_K, backgroundGMM.covarianceModel(), backBins, backComponent);
+
+			#pragma omp section
+			selectHistogramClusters(foregroundGMM.m_gaussians, foregroundGMM.m_minK, foregroundGMM.m_K, foregroundGMM.covarianceModel(), foreBins, foreComponent);
+		}
+
+		// Every pixel takes the cluster of its bin
+		#pragma omp parallel for schedule(dynamic, BandRows)
+		for (int y = 0; y < (int)image.height(); ++y)
+		{
+			const ColorN<N, S>* colors = image.row(y);
+			const BitWord* segmentation = hardSegmentation.row(y);
+			unsigned char* component = components.row(y);
+
+			for (unsigned int x = 0; x < image.width(); ++x)
+			{
+				unsigned int bin = histogramBin(toColor<T>(colors[x]));
+				component[x] = (unsigned char)(BitImage::bit(segmentation, x) ? foreComponent[bin] : backComponent[bin]);
+			}
+		}
+
+		return;
+	}
+
+	// Step 3: Build GMMs using Orchard-Bouman clustering algorithm
+
+	// Gather the colors of each segment (the sampled ones only, with a sampler) in image order. Bands
+	// count their pixels first, so that they can then fill their part of the arrays in parallel.
+	const int bands = bandCount(image.height());
+	std::vector<unsigned int> foreOffset(bands+1, 0), backOffset(bands+1, 0);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int band = 0; band < bands; ++band)
+	{
+		unsigned int yEnd = (band+1)*BandRows < (int)image.height() ? (band+1)*BandRows : image.height();
+
+		for (unsigned int y = band*BandRows; y < yEnd; ++y)
+		{
+			const BitWord* segmentation = hardSegmentation.row(y);
+
+			for (unsigned int x = 0; x < image.width(); ++x)
+			{
+				SegmentationValue segment = segmentationValue(segmentation, x);
+				if (sampler && !sampler->isSample(x, y, segment))
+					continue;
+
+				if (segment == SegmentationForeground)
+					foreOffset[band+1]++;
+				else
+					backOffset[band+1]++;
+			}
+		}
+	}
+
+	for (int band = 0; band < bands; ++band)
+	{
+		foreOffset[band+1] += foreOffset[band];
+		backOffset[band+1] += backOffset[band];
+	}
+
+	std::vector<ColorN<N, T> > foreColors(foreOffset[bands]), backColors(backOffset[bands]);
+	std::vector<unsigned int> forePixels(foreOffset[bands]), backPixels(backOffset[bands]);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int band = 0; band < bands; ++band)
+	{
+		unsigned int yEnd = (band+1)*BandRows < (int)image.height() ? (band+1)*BandRows : image.height();
+		unsigned int fore = foreOffset[band], back = backOffset[band];
+
+		for (unsigned int y = band*BandRows; y < yEnd; ++y)
+		{
+			const ColorN<N, S>* colors = image.row(y);
+			const BitWord* segmentation = hardSegmentation.row(y);
+
+			for (unsigned int x = 0; x < image.width(); ++x)
+			{
+				SegmentationValue segment = segmentationValue(segmentation, x);
+				if (sampler && !sampler->isSample(x, y, segment))
+					continue;
+
+				// Pixels are kept as their offset in the component image
+				if (segment == SegmentationForeground)
+				{
+					foreColors[fore] = toColor<T>(colors[x]);
+					forePixels[fore++] = components.offset(x, y);
+				}
+				else
+				{
+					backColors[back] = toColor<T>(colors[x]);
+					backPixels[back++] = components.offset(x, y);
+				}
+			}
+		}
+	}
+
+	// The two models are clustered independently of each other
+	#pragma omp parallel sections
+	{
+		#pragma omp section
+		buildGMM(backgroundGMM.m_gaussians, backgroundGMM.m_minK, backgroundGMM.m_K, backgroundGMM.covarianceModel(), backColors, backPixels, components);
+
+		#pragma omp section
+		buildGMM(foregroundGMM.m_gaussians, foregroundGMM.m_minK, foregroundGMM.m_K, foregroundGMM.covarianceModel(), foreColors, forePixels, components);
+	}
+}
+
+// Step 4 of learnGMMs
+template <unsigned int N, typename T, typename S>
+static void assignGMMComponents(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation)
+{
+	// Step 4: Assign each pixel to the component which maximizes its probability
+	// Pixels are gathered per row by segmentation and evaluated in batch; the argmax is taken in the
+	// log domain, which picks the same component without the exp. Rows are independent and run in parallel.
+	#pragma omp parallel
+	{
+	std::vector<ColorN<N, T> > foreColors(image.width()), backColors(image.width());
+	std::vector<unsigned int> foreX(image.width()), backX(image.width());
+	std::vector<T> forePlanes(foregroundGMM.K()*image.width()), backPlanes(backgroundGMM.K()*image.width());
+
+	#pragma omp for schedule(dynamic, BandRows)
+	for (int y = 0; y < (int)image.height(); ++y)
+	{
+		const ColorN<N, S>* row = image.row(y);
+		const BitWord* segmentation = hardSegmentation.row(y);
+		unsigned char* component = components.row(y);
+		unsigned int nFore = 0, nBack = 0;
+
+		for (unsigned int x = 0; x < image.width(); ++x)
+		{
+			if (BitImage::bit(segmentation, x))
+			{
+				foreColors[nFore] = toColor<T>(row[x]);
+				foreX[nFore++] = x;
+			}
+			else
+			{
+				backColors[nBack] = toColor<T>(row[x]);
+				backX[nBack++] = x;
+			}
+		}
+
+		if (nFore)
+			foregroundGMM.componentDensities(&foreColors[0], nFore, &forePlanes[0], true);
+		if (nBack)
+			backgroundGMM.componentDensities(&backColors[0], nBack, &backPlanes[0], true);
+
+		for (unsigned int j = 0; j < nFore; ++j)
+		{
+			int k = 0;
+			T max = LogZero;
+
+			for (unsigned int i = 0; i < foregroundGMM.K(); i++)
+			{
+				T p = forePlanes[i*nFore + j];
+				if (p > max)
+				{
+					k = i;
+					max = p;
+				}
+			}
+
+			component[foreX[j]] = (unsigned char)k;
+		}
+
+		for (unsigned int j = 0; j < nBack; ++j)
+		{
+			int k = 0;
+			T max = LogZero;
+
+			for (unsigned int i = 0; i < backgroundGMM.K(); i++)
+			{
+				T p = backPlanes[i*nBack + j];
+				if (p > max)
+				{
+					k = i;
+					max = p;
+				}
+			}
+
+			component[backX[j]] = (unsigned char)k;
+		}
+	}
+	}
+}
+
+template <unsigned int N, typename T, typename S>
+void learnGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation,
+			   bool assignComponents, GMMStatisticsN<N, T>* statistics, const FitSampler* sampler)
+{
+	if (assignComponents)
+		assignGMMComponents(backgroundGMM, foregroundGMM, components, image, hardSegmentation);
+
+	// Step 5: Relearn GMMs from new component assignments
+	if (statistics)
+	{
+		// Only the pixels whose (segmentation, component) changed are moved between the persistent sums
+		statistics->update(components, image, hardSegmentation, sampler);
+
+		for (unsigned int i = 0; i < backgroundGMM.K(); i++)
+			statistics->backFitter(i).finalize(backgroundGMM.m_gaussians[i], statistics->backCount(), false, backgroundGMM.covarianceModel());
+
+		for (unsigned int i = 0; i < foregroundGMM.K(); i++)
+			statistics->foreFitter(i).finalize(foregroundGMM.m_gaussians[i], statistics->foreCount(), false, foregroundGMM.covarianceModel());
+
+		if (backgroundGMM.covarianceModel() == CovarianceTied)
+			tieCovariances(backgroundGMM.m_gaussians, backgroundGMM.K());
+		if (foregroundGMM.covarianceModel() == CovarianceTied)
+			tieCovariances(foregroundGMM.m_gaussians, foregroundGMM.K());
+
+		return;
+	}
+
+	// Set up Gaussian Fitters, one set per band that are then merged in band order
+	const unsigned int backK = backgroundGMM.K(), foreK = foregroundGMM.K();
+	const int bands = bandCount(image.height());
+
+	std::vector<GaussianFitterN<N, T> > bandBack(bands*backK), bandFore(bands*foreK);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int band = 0; band < bands; ++band)
+	{
+		GaussianFitterN<N, T>* backFitters = &bandBack[band*backK];
+		GaussianFitterN<N, T>* foreFitters = &bandFore[band*foreK];
+		unsigned int yEnd = (band+1)*BandRows < (int)image.height() ? (band+1)*BandRows : image.height();
+
+		for (unsigned int y = band*BandRows; y < yEnd; ++y)
+		{
+			const ColorN<N, S>* colors = image.row(y);
+			const BitWord* segmentation = hardSegmentation.row(y);
+			const unsigned char* component = components.row(y);
+
+			for(unsigned int x = 0; x < image.width(); ++x)
+			{
+				ColorN<N, T> c = toColor<T>(colors[x]);
+				SegmentationValue segment = segmentationValue(segmentation, x);
+
+				if (sampler && !sampler->isSample(x, y, segment))
+					continue;
+
+				if(segment == SegmentationForeground)
+					foreFitters[component[x]].add(c);
+				else
+					backFitters[component[x]].add(c);
+			}
+		}
+	}
+
+	GaussianFitterN<N, T>* backFitters = new GaussianFitterN<N, T>[backK];
+	GaussianFitterN<N, T>* foreFitters = new GaussianFitterN<N, T>[foreK];
+
+	unsigned int foreCount = 0, backCount = 0;
+
+	for (int band = 0; band < bands; ++band)
+	{
+		for (unsigned int i = 0; i < backK; i++)
+			backFitters[i].add(bandBack[band*backK + i]);
+		for (unsigned int i = 0; i < foreK; i++)
+			foreFitters[i].add(bandFore[band*foreK + i]);
+	}
+
+	for (unsigned int i = 0; i < backK; i++)
+		backCount += backFitters[i].samples();
+	for (unsigned int i = 0; i < foreK; i++)
+		foreCount += foreFitters[i].samples();
+
+	for (unsigned int i = 0; i < backgroundGMM.K(); i++)
+		backFitters[i].finalize(backgroundGMM.m_gaussians[i], backCount, false, backgroundGMM.covarianceModel());
+
+	for (unsigned int i = 0; i < foregroundGMM.K(); i++)
+		foreFitters[i].finalize(foregroundGMM.m_gaussians[i], foreCount, false, foregroundGMM.covarianceModel());
+
+	if (backgroundGMM.covarianceModel() == CovarianceTied)
+		tieCovariances(backgroundGMM.m_gaussians, backgroundGMM.K());
+	if (foregroundGMM.covarianceModel() == CovarianceTied)
+		tieCovariances(foregroundGMM.m_gaussians, foregroundGMM.K());
+
+	delete [] backFitters;
+	delete [] foreFitters;
+}
+
+// The log-density of all the pixels of a group under Gaussian g, pi not applied
+template <unsigned int N, typename T>
+static inline double groupLogDensity(const GaussianN<N, T>& g, const GaussianFitterN<N, T>& group)
+{
+	if (g.pi <= 0 || g.determinant <= 0)
+		return LogZero;
+
+	return group.samples()*(double)g.logNorm - 0.5*group.mahalanobis(g);
+}
+
+// The component a group is most likely under, and its cost. By Jensen, for any weights r_i shared by its
+// n pixels, sum -log p <= sum_i r_i (-log pi_i p_i(group)) + n sum_i r_i log r_i, which is lowest for
+// r_i ~ pi_i exp(log p_i(group)/n): n times the mixture -log p of a pixel with the average log-density of
+// the group. Either output may be null.
+template <unsigned int N, typename T>
+static void scoreGroup(const GMMN<N, T>& gmm, const GaussianFitterN<N, T>& group, unsigned int* component, T* cost)
+{
+	const double n = group.samples() ? group.samples() : 1;
+	double best = LogZero, bestWeighted = LogZero;
+	std::vector<double> weighted(gmm.K());
+
+	if (component)
+		*component = 0;
+
+	for (unsigned int i = 0; i < gmm.K(); i++)
+	{
+		const GaussianN<N, T>& g = gmm.gaussian(i);
+		double l = groupLogDensity(g, group);
+
+		if (l > best)
+		{
+			best = l;
+			if (component)
+				*component = i;
+		}
+
+		weighted[i] = g.pi > 0 ? l/n + (double)g.logPi : LogZero;
+		bestWeighted = weighted[i] > bestWeighted ? weighted[i] : bestWeighted;
+	}
+
+	if (!cost)
+		return;
+
+	double sum = 0;
+	for (unsigned int i = 0; i < gmm.K(); i++)
+	{
+		if (weighted[i] > LogZero)
+			sum += exp(weighted[i] - bestWeighted);
+	}
+
+	*cost = (T)(-n*(bestWeighted + log(sum)));
+}
+
+template <unsigned int N, typename T>
+void buildGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const std::vector<GaussianFitterN<N, T> >& groups,
+			   const SegmentationImage& hardSegmentation)
+{
+	// Start from the full capacity, the clustering picks K again if it is adaptive
+	backgroundGMM.m_K = backgroundGMM.m_capacity;
+	foregroundGMM.m_K = foregroundGMM.m_capacity;
+
+	// Each model clusters the groups of its segment, the others left empty
+	const unsigned int n = (unsigned int)groups.size();
+	const BitWord* segmentation = hardSegmentation.row(0);
+	std::vector<GaussianFitterN<N, T> > backGroups(n), foreGroups(n);
+
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		if (BitImage::bit(segmentation, j))
+			foreGroups[j] = groups[j];
+		else
+			backGroups[j] = groups[j];
+	}
+
+	std::vector<unsigned int> backComponent(n, 0), foreComponent(n, 0);
+	selectHistogramClusters(backgroundGMM.m_gaussians, backgroundGMM.m_minK, backgroundGMM.m_K, backgroundGMM.covarianceModel(), backGroups, backComponent);
+	selectHistogramClusters(foregroundGMM.m_gaussians, foregroundGMM.m_minK, foregroundGMM.m_K, foregroundGMM.covarianceModel(), foreGroups, foreComponent);
+
+	unsigned char* component = components.row(0);
+	for (unsigned int j = 0; j < n; ++j)
+		component[j] = (unsigned char)(BitImage::bit(segmentation, j) ? foreComponent[j] : backComponent[j]);
+}
+
+template <unsigned int N, typename T>
+void learnGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const std::vector<GaussianFitterN<N, T> >& groups,
+			   const SegmentationImage& hardSegmentation, bool assignComponents)
+{
+	const unsigned int n = (unsigned int)groups.size();
+	const BitWord* segmentation = hardSegmentation.row(0);
+	unsigned char* component = components.row(0);
+
+	// Step 4: Assign each group to the component which maximizes the probability of its pixels
+	if (assignComponents)
+	{
+		for (unsigned int j = 0; j < n; ++j)
+		{
+			unsigned int k;
+			scoreGroup(BitImage::bit(segmentation, j) ? foregroundGMM : backgroundGMM, groups[j], &k, (T*)0);
+			component[j] = (unsigned char)k;
+		}
+	}
+
+	// Step 5: Relearn GMMs from the sums of the groups of each component
+	GaussianFitterN<N, T>* backFitters = new GaussianFitterN<N, T>[backgroundGMM.K()];
+	GaussianFitterN<N, T>* foreFitters = new GaussianFitterN<N, T>[foregroundGMM.K()];
+
+	unsigned int foreCount = 0, backCount = 0;
+
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		if (BitImage::bit(segmentation, j))
+		{
+			foreFitters[component[j]].add(groups[j]);
+			foreCount += groups[j].samples();
+		}
+		else
+		{
+			backFitters[component[j]].add(groups[j]);
+			backCount += groups[j].samples();
+		}
+	}
+
+	for (unsigned int i = 0; i < backgroundGMM.K(); i++)
+		backFitters[i].finalize(backgroundGMM.m_gaussians[i], backCount, false, backgroundGMM.covarianceModel());
+
+	for (unsigned int i = 0; i < foregroundGMM.K(); i++)
+		foreFitters[i].finalize(foregroundGMM.m_gaussians[i], foreCount, false, foregroundGMM.covarianceModel());
+
+	if (backgroundGMM.covarianceModel() == CovarianceTied)
+		tieCovariances(backgroundGMM.m_gaussians, backgroundGMM.K());
+	if (foregroundGMM.covarianceModel() == CovarianceTied)
+		tieCovariances(foregroundGMM.m_gaussians, foregroundGMM.K());
+
+	delete [] backFitters;
+	delete [] foreFitters;
+}
+
+template <unsigned int N, typename T>
+void evaluateGMMs(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const GaussianFitterN<N, T>* groups, unsigned int n,
+				  unsigned int* backComponent, unsigned int* foreComponent, T* backCost, T* foreCost)
+{
+	for (unsigned int j = 0; j < n; ++j)
+	{
+		if (backComponent || backCost)
+			scoreGroup(backgroundGMM, groups[j], backComponent ? &backComponent[j] : 0, backCost ? &backCost[j] : 0);
+		if (foreComponent || foreCost)
+			scoreGroup(foregroundGMM, groups[j], foreComponent ? &foreComponent[j] : 0, foreCost ? &foreCost[j] : 0);
+	}
+}
+
+// GMMStatistics functions
+template <unsigned int N, typename T>
+GMMStatisticsN<N, T>::GMMStatisticsN(unsigned int width, unsigned int height, unsigned int backK, unsigned int foreK)
+	: m_bucket(width, height), m_backK(backK), m_foreK(foreK)
+{
+	m_backFitters = new GaussianFitterN<N, T>[m_backK];
+	m_foreFitters = new GaussianFitterN<N, T>[m_foreK];
+
+	reset();
+}
+
+template <unsigned int N, typename T>
+GMMStatisticsN<N, T>::~GMMStatisticsN()
+{
+	if (m_backFitters)
+		delete [] m_backFitters;
+	if (m_foreFitters)
+		delete [] m_foreFitters;
+}
+
+template <unsigned int N, typename T>
+void GMMStatisticsN<N, T>::reset()
+{
+	for (unsigned int i = 0; i < m_backK; i++)
+		m_backFitters[i] = GaussianFitterN<N, T>();
+	for (unsigned int i = 0; i < m_foreK; i++)
+		m_foreFitters[i] = GaussianFitterN<N, T>();
+
+	m_backCount = 0;
+	m_foreCount = 0;
+
+	m_bucket.fill(NoBucket);
+}
+
+template <unsigned int N, typename T>
+template <typename S>
+unsigned int GMMStatisticsN<N, T>::update(const Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation,
+								   const FitSampler* sampler)
+{
+	// Each band collects the samples it adds to and removes from every bucket, merged in band order below
+	const int bands = bandCount(image.height());
+
+	std::vector<GaussianFitterN<N, T> > addedBack(bands*m_backK), removedBack(bands*m_backK);
+	std::vector<GaussianFitterN<N, T> > addedFore(bands*m_foreK), removedFore(bands*m_foreK);
+	std::vector<unsigned int> bandMoved(bands, 0);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int band = 0; band < bands; ++band)
+	{
+		GaussianFitterN<N, T>* addBack = &addedBack[band*m_backK];
+		GaussianFitterN<N, T>* removeBack = &removedBack[band*m_backK];
+		GaussianFitterN<N, T>* addFore = &addedFore[band*m_foreK];
+		GaussianFitterN<N, T>* removeFore = &removedFore[band*m_foreK];
+		unsigned int yEnd = (band+1)*BandRows < (int)image.height() ? (band+1)*BandRows : image.height();
 
-	if (m_gaussians)
+		for (unsigned int y = band*BandRows; y < yEnd; ++y)
+		{
+			const ColorN<N, S>* colors = image.row(y);
+			const BitWord* segmentation = hardSegmentation.row(y);
+			const unsigned char* component = components.row(y);
+			unsigned char* buckets = m_bucket.row(y);
+
+			for (unsigned int x = 0; x < image.width(); ++x)
+			{
+				unsigned char old = buckets[x];
+				unsigned char bucket = component[x];
+				SegmentationValue segment = segmentationValue(segmentation, x);
+
+				// Pixels that are not (or no longer) sampled belong in no bucket
+				if (sampler && !sampler->isSample(x, y, segment))
+					bucket = NoBucket;
+				else if (segment == SegmentationForeground)
+					bucket |= ForegroundBucket;
+
+				if (old == bucket)
+					continue;
+
+				ColorN<N, T> c = toColor<T>(colors[x]);
+
+				if (old != NoBucket)
+				{
+					if (old & ForegroundBucket)
+						removeFore[old & ~ForegroundBucket].add(c);
+					else
+						removeBack[old].add(c);
+				}
+
+				if (bucket != NoBucket)
+				{
+					if (bucket & ForegroundBucket)
+						addFore[bucket & ~ForegroundBucket].add(c);
+					else
+						addBack[bucket].add(c);
+				}
+
+				buckets[x] = bucket;
+				bandMoved[band]++;
+			}
+		}
+	}
+
+	unsigned int moved = 0;
+
+	for (int band = 0; band < bands; ++band)
 	{
-		for (unsigned int i=0; i < m_K; i++)
+		for (unsigned int i = 0; i < m_backK; i++)
 		{
-			result += m_gaussians[i].pi * p(i, c);
+			m_backFitters[i].add(addedBack[band*m_backK + i]);
+			m_backFitters[i].remove(removedBack[band*m_backK + i]);
+		}
+
+		for (unsigned int i = 0; i < m_foreK; i++)
+		{
+			m_foreFitters[i].add(addedFore[band*m_foreK + i]);
+			m_foreFitters[i].remove(removedFore[band*m_foreK + i]);
 		}
+
+		moved += bandMoved[band];
 	}
 
-	return result;
+	m_backCount = 0;
+	for (unsigned int i = 0; i < m_backK; i++)
+		m_backCount += m_backFitters[i].samples();
+
+	m_foreCount = 0;
+	for (unsigned int i = 0; i < m_foreK; i++)
+		m_foreCount += m_foreFitters[i].samples();
+
+	return moved;
 }
 
-Real GMM::p(unsigned int i, Color c)
+// Merge pairs of components of one GMM while that lowers its BIC, see reduceGMMs
+template <unsigned int N, typename T>
+static bool reduceGMM(GaussianN<N, T>* gaussians, unsigned int minK, unsigned int& K, CovarianceModel model, std::vector<GaussianFitterN<N, T> >& fitters, unsigned int total)
 {
-	Real result = 0;
+	const double penalty = componentPenalty<N>(model, total);
+	std::vector<double> logLikelihood(K);
+	bool reduced = false;
 
-	if( m_gaussians[i].pi > 0 )
+	for (unsigned int i = 0; i < K; i++)
+		logLikelihood[i] = componentLogLikelihood(fitters[i], total, model);
+
+	while (K > minK)
 	{
-		if (m_gaussians[i].determinant > 0)
+		// Change of half the BIC when merging i and j, the best (most negative) one
+		double best = 0, bestMerged = 0;
+		unsigned int bestI = 0, bestJ = 0;
+
+		for (unsigned int i = 0; i < K; i++)
 		{
-			Real r = c.r - m_gaussians[i].mu.r;
-			Real g = c.g - m_gaussians[i].mu.g;
-			Real b = c.b - m_gaussians[i].mu.b;
-			
-			Real d = r * (r*m_gaussians[i].inverse[0][0] + g*m_gaussians[i].inverse[1][0] + b*m_gaussians[i].inverse[2][0]) +
-					g * (r*m_gaussians[i].inverse[0][1] + g*m_gaussians[i].inverse[1][1] + b*m_gaussians[i].inverse[2][1]) +
-					b * (r*m_gaussians[i].inverse[0][2] + g*m_gaussians[i].inverse[1][2] + b*m_gaussians[i].inverse[2][2]);
+			for (unsigned int j = i+1; j < K; j++)
+			{
+				GaussianFitterN<N, T> merged = fitters[i];
+				merged.add(fitters[j]);
+
+				double mergedLogLikelihood = componentLogLikelihood(merged, total, model);
+				double change = logLikelihood[i] + logLikelihood[j] - mergedLogLikelihood - penalty;
 
-			result = (Real)(1.0/(sqrt(m_gaussians[i].determinant)) * exp(-0.5*d));
+				if (change < best)
+				{
+					best = change;
+					bestMerged = mergedLogLikelihood;
+					bestI = i;
+					bestJ = j;
+				}
+			}
 		}
+
+		if (best >= 0)
+			break;
+
+		// Merge j into i, and move the last component into j's place
+		fitters[bestI].add(fitters[bestJ]);
+		logLikelihood[bestI] = bestMerged;
+		fitters[bestJ] = fitters[K-1];
+		logLikelihood[bestJ] = logLikelihood[K-1];
+		K--;
+		reduced = true;
 	}
 
-	return result;
+	if (reduced)
+	{
+		for (unsigned int i = 0; i < K; i++)
+			fitters[i].finalize(gaussians[i], total, false, model);
+
+		if (model == CovarianceTied)
+			tieCovariances(gaussians, K);
+	}
+
+	return reduced;
 }
 
-void buildGMMs(GMM& backgroundGMM, GMM& foregroundGMM, Image<unsigned int>& components, const Image<Color>& image, const Image<SegmentationValue>& hardSegmentation)
+template <unsigned int N, typename T>
+bool reduceGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, const GMMStatisticsN<N, T>& statistics)
 {
-	// Step 3: Build GMMs using Orchard-Bouman clustering algorithm
+	bool reduced = false;
 
-	// Set up Gaussian Fitters
-	GaussianFitter* backFitters = new GaussianFitter[backgroundGMM.K()];
-	GaussianFitter* foreFitters = new GaussianFitter[foregroundGMM.K()];
+	if (backgroundGMM.m_minK < backgroundGMM.m_K)
+	{
+		std::vector<GaussianFitterN<N, T> > fitters(backgroundGMM.m_K);
+		for (unsigned int i = 0; i < backgroundGMM.m_K; i++)
+			fitters[i] = statistics.backFitter(i);
 
-	unsigned int foreCount = 0, backCount = 0;
+		reduced |= reduceGMM(backgroundGMM.m_gaussians, backgroundGMM.m_minK, backgroundGMM.m_K, backgroundGMM.covarianceModel(), fitters, statistics.backCount());
+	}
 
-	// Initialize the first foreground and background clusters
-	for (unsigned int y = 0; y < image.height(); ++y)
+	if (foregroundGMM.m_minK < foregroundGMM.m_K)
 	{
-		for (unsigned int x = 0; x < image.width(); ++x)
-		{
-			components(x,y) = 0;
+		std::vector<GaussianFitterN<N, T> > fitters(foregroundGMM.m_K);
+		for (unsigned int i = 0; i < foregroundGMM.m_K; i++)
+			fitters[i] = statistics.foreFitter(i);
 
-			if (hardSegmentation(x,y) == SegmentationForeground)
-			{
-				foreFitters[0].add(image(x,y));
-				foreCount++;
-			}
-			else
-			{
-				backFitters[0].add(image(x,y));
-				backCount++;
-			}
-		}
+		reduced |= reduceGMM(foregroundGMM.m_gaussians, foregroundGMM.m_minK, foregroundGMM.m_K, foregroundGMM.covarianceModel(), fitters, statistics.foreCount());
 	}
 
-	backFitters[0].finalize(backgroundGMM.m_gaussians[0], backCount, true);
-	foreFitters[0].finalize(foregroundGMM.m_gaussians[0], foreCount, true);
+	return reduced;
+}
 
-	unsigned int nBack = 0, nFore = 0;		// Which cluster will be split
-	unsigned int maxK = backgroundGMM.K() > foregroundGMM.K() ? backgroundGMM.K() : foregroundGMM.K();
-	
-	// Compute clusters
-	for (unsigned int i = 1; i < maxK; i++)
+
+// FitSampler functions
+FitSampler::FitSampler(SamplingMode mode, unsigned int maxSamples)
+	: m_mode(mode), m_maxSamples(maxSamples), m_backStride(1), m_foreStride(1)
+{
+}
+
+void FitSampler::update(const SegmentationImage& hardSegmentation)
+{
+	m_backStride = m_foreStride = 1;
+
+	if (m_mode == SamplingAll || m_maxSamples == 0)
+		return;
+
+	unsigned int foreCount = hardSegmentation.count();
+	unsigned int backCount = hardSegmentation.width()*hardSegmentation.height() - foreCount;
+
+	// One sample per stride x stride cell keeps about count/stride^2 <= maxSamples pixels
+	while (backCount > (double)m_backStride*m_backStride*m_maxSamples)
+		m_backStride++;
+	while (foreCount > (double)m_foreStride*m_foreStride*m_maxSamples)
+		m_foreStride++;
+}
+
+
+// GMMColorTable functions
+template <unsigned int N, typename T>
+GMMColorTableN<N, T>::GMMColorTableN(unsigned int bits) : m_bits(bits), m_levels(1u << bits)
+{
+	unsigned int size = 1u << (N*m_bits);
+
+	m_backCost.resize(size);
+	m_foreCost.resize(size);
+	m_errorBound.resize(size);
+	m_backComponent.resize(size);
+	m_foreComponent.resize(size);
+}
+
+template <unsigned int N, typename T>
+void GMMColorTableN<N, T>::build(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM)
+{
+	std::vector<ColorN<N, T> > centers(m_levels);
+	std::vector<unsigned int> backComponents(m_levels), foreComponents(m_levels);
+
+	// One run of the fused evaluation per line of the cube along the last channel, the others fixed by
+	// the digits of the line number
+	const unsigned int lines = 1u << ((N-1)*m_bits);
+
+	for (unsigned int l = 0; l < lines; ++l)
 	{
-		// Reset the fitters for the splitting clusters
-		backFitters[nBack] = GaussianFitter();
-		foreFitters[nFore] = GaussianFitter();
+		unsigned int line = l << m_bits;
 
-		// For brevity, get references to the splitting Gaussians
-		Gaussian& bg = backgroundGMM.m_gaussians[nBack];
-		Gaussian& fg = foregroundGMM.m_gaussians[nFore];
+		for (unsigned int b = 0; b < m_levels; ++b)
+		{
+			for (unsigned int k = 0; k+1 < N; k++)
+				centers[b][k] = (((l >> ((N-2-k)*m_bits)) & (m_levels-1)) + (T)0.5)/m_levels;
+			centers[b][N-1] = (b+(T)0.5)/m_levels;
+		}
 
-		// Compute splitting points
-		Real splitBack = bg.eigenvectors[0][0] * bg.mu.r + bg.eigenvectors[1][0] * bg.mu.g + bg.eigenvectors[2][0] * bg.mu.b;
-		Real splitFore = fg.eigenvectors[0][0] * fg.mu.r + fg.eigenvectors[1][0] * fg.mu.g + fg.eigenvectors[2][0] * fg.mu.b;
+		evaluateGMMs(backgroundGMM, foregroundGMM, &centers[0], m_levels, &backComponents[0], &foreComponents[0],
+					 &m_backCost[line], &m_foreCost[line]);
 
-		// Split clusters nBack and nFore, place split portion into cluster i
-		for (unsigned int y = 0; y < image.height(); ++y)
+		for (unsigned int b = 0; b < m_levels; ++b)
 		{
-			for(unsigned int x = 0; x < image.width(); ++x)
-			{
-				Color c = image(x,y);
+			m_backComponent[line+b] = (unsigned char)backComponents[b];
+			m_foreComponent[line+b] = (unsigned char)foreComponents[b];
 
-				// For each pixel
-				if (i < foregroundGMM.K() && hardSegmentation(x,y) == SegmentationForeground && components(x,y) == nFore)
-				{
-					if (fg.eigenvectors[0][0] * c.r + fg.eigenvectors[1][0] * c.g + fg.eigenvectors[2][0] * c.b > splitFore)
-					{
-						components(x,y) = i;
-						foreFitters[i].add(c);
-					}
-					else
-					{
-						foreFitters[nFore].add(c);
-					}
-				}
-				else if (i < backgroundGMM.K() && hardSegmentation(x,y) == SegmentationBackground && components(x,y) == nBack)
-				{
-					if (bg.eigenvectors[0][0] * c.r + bg.eigenvectors[1][0] * c.g + bg.eigenvectors[2][0] * c.b > splitBack)
-					{
-						components(x,y) = i;
-						backFitters[i].add(c);
-					}
-					else
-					{
-						backFitters[nBack].add(c);
-					}
-				}
-			}
+			T back = cellErrorBound(backgroundGMM, centers[b]);
+			T fore = cellErrorBound(foregroundGMM, centers[b]);
+			m_errorBound[line+b] = back > fore ? back : fore;
 		}
+	}
+}
 
-		
-		// Compute new split Gaussians
-		backFitters[nBack].finalize(backgroundGMM.m_gaussians[nBack], backCount, true);
-		foreFitters[nFore].finalize(foregroundGMM.m_gaussians[nFore], foreCount, true);
+template <unsigned int N, typename T>
+T GMMColorTableN<N, T>::cellErrorBound(const GMMN<N, T>& gmm, const ColorN<N, T>& center) const
+{
+	const T h = (T)(0.5*sqrt((double)N)/m_levels);	// half the cell diagonal
+	T maxGradient = 0;
 
-		if (i < backgroundGMM.K())
-			backFitters[i].finalize(backgroundGMM.m_gaussians[i], backCount, true);
-		if (i < foregroundGMM.K())
-			foreFitters[i].finalize(foregroundGMM.m_gaussians[i], foreCount, true);
+	for (unsigned int i = 0; i < gmm.K(); i++)
+	{
+		const GaussianN<N, T>& g = gmm.gaussian(i);
+		if (g.pi <= 0 || g.determinant <= 0)
+			continue;
 
-		// Find clusters with highest eigenvalue
-		nBack = 0;
-		nFore = 0;
+		// Frobenius norm of the inverse, each doubled off diagonal coefficient stands for two entries
+		T diagonal = 0, offDiagonal = 0;
+		for (unsigned int k = 0; k < N; k++)
+			diagonal += g.coef[k]*g.coef[k];
+		for (unsigned int k = N; k < N*(N+1)/2; k++)
+			offDiagonal += g.coef[k]*g.coef[k];
 
-		for (unsigned int j = 0; j <= i; j++ )
-		{
-			if (j < backgroundGMM.K() && backgroundGMM.m_gaussians[j].eigenvalues[0] > backgroundGMM.m_gaussians[nBack].eigenvalues[0])
-				nBack = j;
+		T norm = sqrt(diagonal + (T)0.5*offDiagonal);
+		T distance = sqrt(distance2(center, g.mu)) + h;
 
-			if (j < foregroundGMM.K() && foregroundGMM.m_gaussians[j].eigenvalues[0] > foregroundGMM.m_gaussians[nFore].eigenvalues[0])
-				nFore = j;
-		}
+		if (norm*distance > maxGradient)
+			maxGradient = norm*distance;
 	}
 
-	delete [] backFitters;
-	delete [] foreFitters;
+	return maxGradient*h;
 }
 
-void learnGMMs(GMM& backgroundGMM, GMM& foregroundGMM, Image<unsigned int>& components, const Image<Color>& image, const Image<SegmentationValue>& hardSegmentation)
+
+// GMMDriftBound functions
+template <unsigned int N, typename T>
+GMMDriftBoundN<N, T>::GMMDriftBoundN(unsigned int bits) : m_bits(bits), m_levels(1u << bits), m_valid(false)
 {
-	// Step 4: Assign each pixel to the component which maximizes its probability
-	for (unsigned int y = 0; y < image.height(); ++y)
+	unsigned int size = 1u << (N*m_bits);
+
+	m_backDrift.resize(size);
+	m_foreDrift.resize(size);
+	m_backStale.resize(size);
+	m_foreStale.resize(size);
+}
+
+template <unsigned int N, typename T>
+void GMMDriftBoundN<N, T>::update(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, T tolerance)
+{
+	if (!m_valid || m_backPrevious.size() != backgroundGMM.K() || m_forePrevious.size() != foregroundGMM.K())
 	{
-		for (unsigned int x = 0; x < image.width(); ++x)
+		std::fill(m_backDrift.begin(), m_backDrift.end(), (T)0);
+		std::fill(m_foreDrift.begin(), m_foreDrift.end(), (T)0);
+		std::fill(m_backStale.begin(), m_backStale.end(), 1);
+		std::fill(m_foreStale.begin(), m_foreStale.end(), 1);
+
+		m_backPrevious.assign(&backgroundGMM.gaussian(0), &backgroundGMM.gaussian(0) + backgroundGMM.K());
+		m_forePrevious.assign(&foregroundGMM.gaussian(0), &foregroundGMM.gaussian(0) + foregroundGMM.K());
+		m_valid = true;
+		return;
+	}
+
+	update(backgroundGMM, m_backPrevious, m_backDrift, m_backStale, tolerance);
+	update(foregroundGMM, m_forePrevious, m_foreDrift, m_foreStale, tolerance);
+}
+
+// Sorts component indices by decreasing change
+struct ChangeOrder
+{
+	const std::vector<double>& change;
+	ChangeOrder(const std::vector<double>& c) : change(c) {}
+	bool operator()(unsigned int i, unsigned int j) const { return change[i] > change[j]; }
+};
+
+template <unsigned int N, typename T>
+void GMMDriftBoundN<N, T>::update(const GMMN<N, T>& gmm, std::vector<GaussianN<N, T> >& previous, std::vector<T>& drift, std::vector<unsigned char>& stale, T tolerance)
+{
+	const double h = 0.5*sqrt((double)N)/m_levels;	// half the cell diagonal
+	const double Huge = 1e30;
+	const unsigned int K = gmm.K();
+
+	// Per component: the constant part of the change of log(pi N), the Frobenius norm of the change of the
+	// inverse covariance (the Hessian of the change, up to sign) and of the previous inverse
+	std::vector<double> constant(K), hessian(K), curvature(K);
+	std::vector<char> active(K);
+	bool vanished = false, any = false;
+
+	for (unsigned int i = 0; i < K; i++)
+	{
+		const GaussianN<N, T>& a = previous[i];
+		const GaussianN<N, T>& b = gmm.gaussian(i);
+
+		active[i] = a.pi > 0 && b.pi > 0;
+		vanished |= (a.pi > 0) != (b.pi > 0);
+		any |= active[i] != 0;
+		constant[i] = active[i] ? ((double)b.logPi + b.logNorm) - ((double)a.logPi + a.logNorm) : 0;
+
+		double change2 = 0, norm2 = 0;
+		for (unsigned int j = 0; j < N; j++)
+		{
+			for (unsigned int k = 0; k < N; k++)
+			{
+				change2 += ((double)b.inverse[j][k] - a.inverse[j][k]) * ((double)b.inverse[j][k] - a.inverse[j][k]);
+				norm2 += (double)a.inverse[j][k] * a.inverse[j][k];
+			}
+		}
+		hessian[i] = sqrt(change2);
+		curvature[i] = sqrt(norm2);
+	}
+
+	std::vector<double> logDensity(K), change(K), variation(K), share(K);
+	std::vector<unsigned int> order(K);
+
+	const unsigned int cells = 1u << (N*m_bits);
+
+	for (unsigned int cell = 0; cell < cells; ++cell)
+	{
+		double c[N];
+		for (unsigned int k = 0; k < N; k++)
+			c[k] = (((cell >> ((N-1-k)*m_bits)) & (m_levels-1)) + 0.5)/m_levels;
+
+		double bound = Huge;
+
+		// Without a component in both models (an empty model) there is nothing to bound the change by
+		if (!vanished && any)
 		{
-			Color c = image(x,y);
+			// Per component at the cell center: the previous log(pi N), a bound on its change over the
+			// cell from the value, gradient and Hessian of the change there, and a bound on how much
+			// the previous log(pi N) itself varies over the cell
+			double maxLog = -Huge;
 
-			if (hardSegmentation(x,y) == SegmentationForeground)
+			for (unsigned int i = 0; i < K; i++)
 			{
-				int k = 0;
-				Real max = 0;
+				if (!active[i])
+					continue;
+
+				const GaussianN<N, T>& a = previous[i];
+				const GaussianN<N, T>& b = gmm.gaussian(i);
+
+				double da[N], db[N];
+				for (unsigned int k = 0; k < N; k++)
+				{
+					da[k] = c[k]-a.mu[k];
+					db[k] = c[k]-b.mu[k];
+				}
 
-				for (unsigned int i = 0; i < foregroundGMM.K(); i++)
+				double value = constant[i], quadratic = 0, gradient2 = 0, slope2 = 0;
+
+				for (unsigned int j = 0; j < N; j++)
 				{
-					Real p = foregroundGMM.p(i, c);
-					if (p > max)
+					double Aa = 0, Ab = 0;
+					for (unsigned int k = 0; k < N; k++)
 					{
-						k = i;
-						max = p;
+						Aa += a.inverse[j][k]*da[k];
+						Ab += b.inverse[j][k]*db[k];
 					}
+
+					quadratic += da[j]*Aa;
+					value += 0.5*(da[j]*Aa - db[j]*Ab);
+					gradient2 += (Aa - Ab)*(Aa - Ab);
+					slope2 += Aa*Aa;
 				}
 
-				components(x, y) = k;
+				logDensity[i] = (double)a.logPi + a.logNorm - 0.5*quadratic;
+				change[i] = fabs(value) + sqrt(gradient2)*h + 0.5*hessian[i]*h*h;
+				variation[i] = sqrt(slope2)*h + 0.5*curvature[i]*h*h;
+
+				if (logDensity[i] > maxLog)
+					maxLog = logDensity[i];
 			}
-			else 
+
+			// Shares w_i of the components in p at the center, and how much log p varies over the cell
+			double sum = 0, varied = 0;
+			for (unsigned int i = 0; i < K; i++)
 			{
-				int k = 0;
-				Real max = 0;
+				if (active[i])
+				{
+					share[i] = exp(logDensity[i] - maxLog);
+					sum += share[i];
+					varied += share[i] * exp(variation[i] < 600 ? variation[i] : 600);
+				}
+			}
+
+			const double logVariation = log(varied / sum);
 
-				for (unsigned int i = 0; i < backgroundGMM.K(); i++)
+			// The change of -log p at a color is log sum w_i exp(d_i), with d_i the change of
+			// component i and w_i its share there, which is at most its share at the center times
+			// exp(variation_i + logVariation). Maximizing over shares that sum to one, under these
+			// caps, gives the bound: fill the largest changes first. By Jensen the same bounds a
+			// decrease.
+			for (unsigned int i = 0; i < K; i++)
+			{
+				order[i] = i;
+				if (active[i])
 				{
-					Real p = backgroundGMM.p(i, c);
-					if (p > max)
-					{
-						k = i;
-						max = p;
-					}
+					share[i] = share[i] / sum * exp(variation[i] + logVariation);
+					if (share[i] > 1)
+						share[i] = 1;
 				}
+				else
+					share[i] = 0;
+			}
+
+			std::sort(order.begin(), order.end(), ChangeOrder(change));
+
+			double remaining = 1, exponential = 0;
+			for (unsigned int j = 0; j < K && remaining > 0; j++)
+			{
+				unsigned int i = order[j];
+				double w = share[i] < remaining ? share[i] : remaining;
 
-				components(x, y) = k;
+				exponential += w * exp(change[i] < 600 ? change[i] : 600);
+				remaining -= w;
 			}
+
+			bound = log(exponential);
 		}
+
+		// A bound of an absolute change is not negative, whatever rounding made of it. A NaN falls
+		// through to Huge.
+		if (bound < 0)
+			bound = 0;
+		drift[cell] += (T)(bound < Huge ? bound : Huge);
+		stale[cell] = drift[cell] > tolerance;
+		if (stale[cell])
+			drift[cell] = 0;
 	}
 
-	// Step 5: Relearn GMMs from new component assignments
+	previous.assign(&gmm.gaussian(0), &gmm.gaussian(0) + gmm.K());
+}
 
-	// Set up Gaussian Fitters
-	GaussianFitter* backFitters = new GaussianFitter[backgroundGMM.K()];
-	GaussianFitter* foreFitters = new GaussianFitter[foregroundGMM.K()];
 
-	unsigned int foreCount = 0, backCount = 0;
+// GaussianFitter functions
+template <unsigned int N, typename T>
+GaussianFitterN<N, T>::GaussianFitterN()
+{
+	for (unsigned int i = 0; i < N; i++)
+	{
+		s[i] = 0;
+		for (unsigned int j = 0; j < N; j++)
+			p[i][j] = 0;
+	}
+
+	count = 0;
+}
 
-	for (unsigned int y = 0; y < image.height(); ++y)
+// Sums and products of the channels of a color sample, added to or subtracted from a fitter's sums.
+// Written out for the channel counts in use, they run once or twice per pixel and iteration.
+template <unsigned int N>
+struct SampleMoments
+{
+	template <typename T>
+	static inline void add(double s[N], double p[N][N], const ColorN<N, T>& c)
 	{
-		for(unsigned int x = 0; x < image.width(); ++x)
+		double v[N];
+		for (unsigned int i = 0; i < N; i++)
+			v[i] = c[i];
+
+		for (unsigned int i = 0; i < N; i++)
 		{
-			Color c = image(x,y);
+			s[i] += v[i];
+			for (unsigned int j = 0; j < N; j++)
+				p[i][j] += v[i]*v[j];
+		}
+	}
 
-			if(hardSegmentation(x,y) == SegmentationForeground)
-			{
-				foreFitters[components(x,y)].add(c);
-				foreCount++;
-			}
-			else
-			{
-				backFitters[components(x,y)].add(c);
-				backCount++;
-			}
+	template <typename T>
+	static inline void remove(double s[N], double p[N][N], const ColorN<N, T>& c)
+	{
+		double v[N];
+		for (unsigned int i = 0; i < N; i++)
+			v[i] = c[i];
+
+		for (unsigned int i = 0; i < N; i++)
+		{
+			s[i] -= v[i];
+			for (unsigned int j = 0; j < N; j++)
+				p[i][j] -= v[i]*v[j];
 		}
 	}
+};
 
-	for (unsigned int i = 0; i < backgroundGMM.K(); i++)
-		backFitters[i].finalize(backgroundGMM.m_gaussians[i], backCount, false);
+template <>
+struct SampleMoments<1>
+{
+	template <typename T>
+	static inline void add(double s[1], double p[1][1], const ColorN<1, T>& c)
+	{
+		double v = c.v;
 
-	for (unsigned int i = 0; i < foregroundGMM.K(); i++)
-		foreFitters[i].finalize(foregroundGMM.m_gaussians[i], foreCount, false);
+		s[0] += v;
+		p[0][0] += v*v;
+	}
 
-	delete [] backFitters;
-	delete [] foreFitters;
+	template <typename T>
+	static inline void remove(double s[1], double p[1][1], const ColorN<1, T>& c)
+	{
+		double v = c.v;
+
+		s[0] -= v;
+		p[0][0] -= v*v;
+	}
+};
+
+template <>
+struct SampleMoments<3>
+{
+	template <typename T>
+	static inline void add(double s[3], double p[3][3], const ColorN<3, T>& c)
+	{
+		double r = c.r, g = c.g, b = c.b;
+
+		s[0] += r; s[1] += g; s[2] += b;
+
+		p[0][0] += r*r; p[0][1] += r*g; p[0][2] += r*b;
+		p[1][0] += g*r; p[1][1] += g*g; p[1][2] += g*b;
+		p[2][0] += b*r; p[2][1] += b*g; p[2][2] += b*b;
+	}
+
+	template <typename T>
+	static inline void remove(double s[3], double p[3][3], const ColorN<3, T>& c)
+	{
+		double r = c.r, g = c.g, b = c.b;
+
+		s[0] -= r; s[1] -= g; s[2] -= b;
+
+		p[0][0] -= r*r; p[0][1] -= r*g; p[0][2] -= r*b;
+		p[1][0] -= g*r; p[1][1] -= g*g; p[1][2] -= g*b;
+		p[2][0] -= b*r; p[2][1] -= b*g; p[2][2] -= b*b;
+	}
+};
+
+template <>
+struct SampleMoments<4>
+{
+	template <typename T>
+	static inline void add(double s[4], double p[4][4], const ColorN<4, T>& c)
+	{
+		double v0 = c.v[0], v1 = c.v[1], v2 = c.v[2], v3 = c.v[3];
+
+		s[0] += v0; s[1] += v1; s[2] += v2; s[3] += v3;
+
+		p[0][0] += v0*v0; p[0][1] += v0*v1; p[0][2] += v0*v2; p[0][3] += v0*v3;
+		p[1][0] += v1*v0; p[1][1] += v1*v1; p[1][2] += v1*v2; p[1][3] += v1*v3;
+		p[2][0] += v2*v0; p[2][1] += v2*v1; p[2][2] += v2*v2; p[2][3] += v2*v3;
+		p[3][0] += v3*v0; p[3][1] += v3*v1; p[3][2] += v3*v2; p[3][3] += v3*v3;
+	}
+
+	template <typename T>
+	static inline void remove(double s[4], double p[4][4], const ColorN<4, T>& c)
+	{
+		double v0 = c.v[0], v1 = c.v[1], v2 = c.v[2], v3 = c.v[3];
+
+		s[0] -= v0; s[1] -= v1; s[2] -= v2; s[3] -= v3;
+
+		p[0][0] -= v0*v0; p[0][1] -= v0*v1; p[0][2] -= v0*v2; p[0][3] -= v0*v3;
+		p[1][0] -= v1*v0; p[1][1] -= v1*v1; p[1][2] -= v1*v2; p[1][3] -= v1*v3;
+		p[2][0] -= v2*v0; p[2][1] -= v2*v1; p[2][2] -= v2*v2; p[2][3] -= v2*v3;
+		p[3][0] -= v3*v0; p[3][1] -= v3*v1; p[3][2] -= v3*v2; p[3][3] -= v3*v3;
+	}
+};
+
+// Add a color sample
+template <unsigned int N, typename T>
+void GaussianFitterN<N, T>::add(ColorN<N, T> c)
+{
+	SampleMoments<N>::add(s, p, c);
+	count++;
 }
 
+// Remove a color sample that was added before
+template <unsigned int N, typename T>
+void GaussianFitterN<N, T>::remove(ColorN<N, T> c)
+{
+	SampleMoments<N>::remove(s, p, c);
+	count--;
+}
 
-// GaussianFitter functions
-GaussianFitter::GaussianFitter()
+// Add all the samples of another fitter
+template <unsigned int N, typename T>
+void GaussianFitterN<N, T>::add(const GaussianFitterN<N, T>& other)
 {
-	s = Color();
+	for (unsigned int i = 0; i < N; i++)
+	{
+		s[i] += other.s[i];
+		for (unsigned int j = 0; j < N; j++)
+			p[i][j] += other.p[i][j];
+	}
 
-	p[0][0] = 0; p[0][1] = 0; p[0][2] = 0;
-	p[1][0] = 0; p[1][1] = 0; p[1][2] = 0;
-	p[2][0] = 0; p[2][1] = 0; p[2][2] = 0;
+	count += other.count;
+}
 
-	count = 0;
+// Remove all the samples of another fitter, which must have been added before
+template <unsigned int N, typename T>
+void GaussianFitterN<N, T>::remove(const GaussianFitterN<N, T>& other)
+{
+	for (unsigned int i = 0; i < N; i++)
+	{
+		s[i] -= other.s[i];
+		for (unsigned int j = 0; j < N; j++)
+			p[i][j] -= other.p[i][j];
+	}
+
+	count -= other.count;
 }
 
-// Add a color sample
-void GaussianFitter::add(Color c)
+// Sum over the added samples of (c-mu)' inverse (c-mu). With m their mean, it is the trace of the inverse
+// times their scatter p - count m m', plus count times the distance of m to mu.
+template <unsigned int N, typename T>
+double GaussianFitterN<N, T>::mahalanobis(const GaussianN<N, T>& g) const
 {
-	s.r += c.r; s.g += c.g; s.b += c.b;
+	if (count == 0)
+		return 0;
 
-	p[0][0] += c.r*c.r; p[0][1] += c.r*c.g; p[0][2] += c.r*c.b;
-	p[1][0] += c.g*c.r; p[1][1] += c.g*c.g; p[1][2] += c.g*c.b;
-	p[2][0] += c.b*c.r; p[2][1] += c.b*c.g; p[2][2] += c.b*c.b;
+	double m[N], d[N];
+	for (unsigned int i = 0; i < N; i++)
+	{
+		m[i] = s[i]/count;
+		d[i] = m[i] - g.mu[i];
+	}
 
-	count++;
+	double sum = 0;
+	for (unsigned int i = 0; i < N; i++)
+		for (unsigned int j = 0; j < N; j++)
+			sum += g.inverse[i][j] * (p[i][j] - count*m[i]*m[j] + count*d[i]*d[j]);
+
+	return sum;
 }
 
 // Build the gaussian out of all the added colors
-void GaussianFitter::finalize(Gaussian& g, unsigned int totalCount, bool computeEigens) const
+template <unsigned int N, typename T>
+void GaussianFitterN<N, T>::finalize(GaussianN<N, T>& g, unsigned int totalCount, bool computeEigens, CovarianceModel model) const
 {
 	// Running into a singular covariance matrix is problematic. So we'll add a small epsilon
 	// value to the diagonal elements to ensure a positive definite covariance matrix.
-	const Real Epsilon = (Real)0.0001;
+	const T Epsilon = (T)0.0001;
 
 	if (count==0)
 	{
 		g.pi = 0;
+		g.logPi = LogZero;
+
+		// An empty cluster is never chosen for splitting
+		if (computeEigens)
+		{
+			for (unsigned int i = 0; i < N; i++)
+				g.eigenvalues[i] = 0;
+		}
 	}
 	else
 	{
-		// Compute mean of gaussian
-		g.mu.r = s.r/count;
-		g.mu.g = s.g/count;
-		g.mu.b = s.b/count;
+		// Compute mean of gaussian (in double, like the sums, to avoid cancellation in the covariance)
+		double mu[N];
+		for (unsigned int i = 0; i < N; i++)
+		{
+			mu[i] = s[i]/count;
+			g.mu[i] = (T)mu[i];
+		}
 
 		// Compute covariance matrix
-		g.covariance[0][0] = p[0][0]/count-g.mu.r*g.mu.r + Epsilon; g.covariance[0][1] = p[0][1]/count-g.mu.r*g.mu.g; g.covariance[0][2] = p[0][2]/count-g.mu.r*g.mu.b;
-		g.covariance[1][0] = p[1][0]/count-g.mu.g*g.mu.r; g.covariance[1][1] = p[1][1]/count-g.mu.g*g.mu.g + Epsilon; g.covariance[1][2] = p[1][2]/count-g.mu.g*g.mu.b;
-		g.covariance[2][0] = p[2][0]/count-g.mu.b*g.mu.r; g.covariance[2][1] = p[2][1]/count-g.mu.b*g.mu.g; g.covariance[2][2] = p[2][2]/count-g.mu.b*g.mu.b + Epsilon;
-
-		// Compute determinant of covariance matrix
-		g.determinant = g.covariance[0][0]*(g.covariance[1][1]*g.covariance[2][2]-g.covariance[1][2]*g.covariance[2][1]) 
-						- g.covariance[0][1]*(g.covariance[1][0]*g.covariance[2][2]-g.covariance[1][2]*g.covariance[2][0]) 
-						+ g.covariance[0][2]*(g.covariance[1][0]*g.covariance[2][1]-g.covariance[1][1]*g.covariance[2][0]);
-
-		// Compute inverse (cofactor matrix divided by determinant)
-		g.inverse[0][0] =  (g.covariance[1][1]*g.covariance[2][2] - g.covariance[1][2]*g.covariance[2][1]) / g.determinant;
-		g.inverse[1][0] = -(g.covariance[1][0]*g.covariance[2][2] - g.covariance[1][2]*g.covariance[2][0]) / g.determinant;
-		g.inverse[2][0] =  (g.covariance[1][0]*g.covariance[2][1] - g.covariance[1][1]*g.covariance[2][0]) / g.determinant;
-		g.inverse[0][1] = -(g.covariance[0][1]*g.covariance[2][2] - g.covariance[0][2]*g.covariance[2][1]) / g.determinant;
-		g.inverse[1][1] =  (g.covariance[0][0]*g.covariance[2][2] - g.covariance[0][2]*g.covariance[2][0]) / g.determinant;
-		g.inverse[2][1] = -(g.covariance[0][0]*g.covariance[2][1] - g.covariance[0][1]*g.covariance[2][0]) / g.determinant;
-		g.inverse[0][2] =  (g.covariance[0][1]*g.covariance[1][2] - g.covariance[0][2]*g.covariance[1][1]) / g.determinant;
-		g.inverse[1][2] = -(g.covariance[0][0]*g.covariance[1][2] - g.covariance[0][2]*g.covariance[1][0]) / g.determinant;
-		g.inverse[2][2] =  (g.covariance[0][0]*g.covariance[1][1] - g.covariance[0][1]*g.covariance[1][0]) / g.determinant;
+		for (unsigned int i = 0; i < N; i++)
+			for (unsigned int j = 0; j < N; j++)
+				g.covariance[i][j] = (T)(p[i][j]/count - mu[i]*mu[j] + (i == j ? Epsilon : 0));
 
-		// The weight of the gaussian is the fraction of the number of pixels in this Gaussian to the number of 
-		// pixels in all the gaussians of this GMM.
-		g.pi = (Real)count/totalCount;
+		// Reduce it to the covariance model
+		if (model == CovarianceDiagonal || model == CovarianceSpherical)
+		{
+			for (unsigned int i = 0; i < N; i++)
+				for (unsigned int j = 0; j < N; j++)
+					if (i != j)
+						g.covariance[i][j] = 0;
+		}
 
-		if (computeEigens)
+		if (model == CovarianceSpherical)
 		{
+			T variance = 0;
+			for (unsigned int i = 0; i < N; i++)
+				variance += g.covariance[i][i];
+			variance /= N;
 
-#ifdef USE_DOUBLE
-	#define CV_TYPE CV_64FC1
-#else
-	#define CV_TYPE CV_32FC1
-#endif
-			// Build OpenCV wrappers around our data.
-			CvMat mat = cvMat(3, 3, CV_TYPE, g.covariance);
-			CvMat eval = cvMat(3, 1, CV_TYPE, g.eigenvalues);
-			CvMat evec = cvMat(3, 3, CV_TYPE, g.eigenvectors);
-			
-			// Compute eigenvalues and vectors using SVD
-			cvSVD( &mat, &eval, &evec );
+			for (unsigned int i = 0; i < N; i++)
+				g.covariance[i][i] = variance;
 		}
+
+		computeInverse(g);
+
+		// The weight of the gaussian is the fraction of the number of pixels in this Gaussian to the number of 
+		// pixels in all the gaussians of this GMM.
+		g.pi = (T)count/totalCount;
+		g.logPi = (T)log((T)count/totalCount);
+
+		if (computeEigens)
+			symmetricEigen<N>(g.covariance, g.eigenvalues, g.eigenvectors);
 	}
 } 
 
-}
\ No newline at end of file
+
+// The channel counts GrabCut is built for: gray, RGB and RGB plus one extra channel, each in single
+// and double precision
+// The functions reading the image, for one storage type S of its channels
+#define INSTANTIATE_GMM_INPUT(N, T, S) \
+	template void buildGMMs(GMMN<N, T>&, GMMN<N, T>&, Image<unsigned char>&, const Image<ColorN<N, S> >&, const SegmentationImage&, \
+							const FitSampler*, GMMInitialization); \
+	template void learnGMMs(GMMN<N, T>&, GMMN<N, T>&, Image<unsigned char>&, const Image<ColorN<N, S> >&, const SegmentationImage&, \
+							bool, GMMStatisticsN<N, T>*, const FitSampler*); \
+	template unsigned int GMMStatisticsN<N, T>::update(const Image<unsigned char>&, const Image<ColorN<N, S> >&, const SegmentationImage&, \
+													   const FitSampler*);
+
+#define INSTANTIATE_GMM(N, T) \
+	template class GMMN<N, T>; \
+	template class GaussianFitterN<N, T>; \
+	template class GMMStatisticsN<N, T>; \
+	template class GMMColorTableN<N, T>; \
+	template class GMMDriftBoundN<N, T>; \
+	INSTANTIATE_GMM_INPUT(N, T, T) \
+	template void componentDensities(const GMMN<N, T>&, const GMMN<N, T>&, const ColorN<N, T>*, unsigned int, T*, T*, bool); \
+	template void evaluateGMMs(const GMMN<N, T>&, const GMMN<N, T>&, const ColorN<N, T>*, unsigned int, unsigned int*, unsigned int*, T*, T*); \
+	template void evaluateGMMs(const GMMN<N, T>&, const GMMN<N, T>&, const T*, unsigned int, unsigned int, unsigned int*, unsigned int*, T*, T*); \
+	template bool reduceGMMs(GMMN<N, T>&, GMMN<N, T>&, const GMMStatisticsN<N, T>&); \
+	template void buildGMMs(GMMN<N, T>&, GMMN<N, T>&, Image<unsigned char>&, const std::vector<GaussianFitterN<N, T> >&, const SegmentationImage&); \
+	template void learnGMMs(GMMN<N, T>&, GMMN<N, T>&, Image<unsigned char>&, const std::vector<GaussianFitterN<N, T> >&, const SegmentationImage&, bool); \
+	template void evaluateGMMs(const GMMN<N, T>&, const GMMN<N, T>&, const GaussianFitterN<N, T>*, unsigned int, unsigned int*, unsigned int*, T*, T*);
+
+INSTANTIATE_GMM(1, float)
+INSTANTIATE_GMM(3, float)
+INSTANTIATE_GMM(4, float)
+INSTANTIATE_GMM(1, double)
+INSTANTIATE_GMM(3, double)
+INSTANTIATE_GMM(4, double)
+
+// 8-bit input, see Color8
+INSTANTIATE_GMM_INPUT(1, float, unsigned char)
+INSTANTIATE_GMM_INPUT(3, float, unsigned char)
+INSTANTIATE_GMM_INPUT(4, float, unsigned char)
+
+}
@@ -14,69 +14,409 @@
 
 namespace GrabCutNS {
 
-struct Gaussian
+// Shape of the covariance matrices of a GMM. Full is the standard GrabCut model; the others trade some
+// accuracy for cheaper likelihood evaluation: diagonal and spherical drop the color correlations (a
+// spherical Gaussian has a single variance), tied shares one full covariance between all components.
+enum CovarianceModel { CovarianceFull, CovarianceDiagonal, CovarianceSpherical, CovarianceTied };
+
+// How buildGMMs clusters the colors of each model: Orchard and Bouman splitting over the pixels, or
+// weighted k-means++ seeding and Lloyd iterations over the bins of a coarse color histogram. The latter
+// makes a single pass over the pixels, the clustering itself no longer depends on the pixel count.
+enum GMMInitialization { InitOrchardBouman, InitHistogramKMeans };
+
+// A Gaussian over colors of N channels, computed in precision T
+template <unsigned int N, typename T = Real>
+struct GaussianN
 {
-	Color mu;					// mean of the gaussian
-	Real covariance[3][3];		// covariance matrix of the gaussian
-	Real determinant;			// determinant of the covariance matrix
-	Real inverse[3][3];			// inverse of the covariance matrix
-	Real pi;					// weighting of this gaussian in the GMM.
+	ColorN<N, T> mu;			// mean of the gaussian
+	T covariance[N][N];			// covariance matrix of the gaussian
+	T determinant;				// determinant of the covariance matrix
+	T inverse[N][N];			// inverse of the covariance matrix
+	T pi;						// weighting of this gaussian in the GMM.
+
+	// Constants precomputed by GaussianFitter::finalize so evaluation does not redo them per pixel.
+	T norm;						// 1/sqrt(determinant)
+	T logNorm;					// -0.5*log(determinant)
+	T logPi;					// log(pi), for evaluation in the log domain
+	T coef[N*(N+1)/2];			// symmetric inverse: the diagonal, then twice the entries above it row by
+								// row (rr, gg, bb, 2rg, 2rb, 2gb for RGB)
 
 	// These are only needed during Orchard and Bouman clustering.
-	Real eigenvalues[3];		// eigenvalues of covariance matrix
-	Real eigenvectors[3][3];	// eigenvectors of   "          "
+	T eigenvalues[N];			// eigenvalues of covariance matrix
+	T eigenvectors[N][N];		// eigenvectors of   "          "
 };
 
-class GMM
+template <unsigned int N, typename T = Real> class GMMN;
+template <unsigned int N, typename T = Real> class GaussianFitterN;
+template <unsigned int N, typename T = Real> class GMMStatisticsN;
+class FitSampler;
+
+// Build the initial GMMs using the Orchard and Bouman color clustering algorithm (or the histogram
+// k-means one). With a sampler, only the sampled pixels are clustered and get a component. The image
+// channels are stored as S, either T or 8 bits (see Color8), here and in learnGMMs.
+template <unsigned int N, typename T, typename S>
+void buildGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation,
+			   const FitSampler* sampler = 0, GMMInitialization initialization = InitOrchardBouman);
+
+// Iteratively learn GMMs using GrabCut updating algorithm. When assignComponents is false, step 4 is
+// skipped and components must already hold the assignment (e.g. computed by evaluateGMMs).
+// With statistics, the Gaussians are refit from persistent sums that are updated incrementally
+// instead of rebuilt from every pixel. With a sampler, only the sampled pixels are fit; all pixels are
+// still assigned a component.
+template <unsigned int N, typename T, typename S>
+void learnGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation,
+			   bool assignComponents = true, GMMStatisticsN<N, T>* statistics = 0, const FitSampler* sampler = 0);
+
+// Evaluate all components of both GMMs for a block of n colors at once, see GMM::componentDensities.
+// backPlanes and forePlanes hold backgroundGMM.K() and foregroundGMM.K() planes of n values.
+template <unsigned int N, typename T>
+void componentDensities(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const ColorN<N, T>* colors, unsigned int n,
+						T* backPlanes, T* forePlanes, bool logDomain = false);
+
+// Fused log-domain evaluation for a block of n colors. The Mahalanobis term of every component is
+// computed once per color; from it both the most likely component of each model (the argmax used by
+// learnGMMs) and the data cost -log p(c) are derived. The cost uses log-sum-exp, so colors far from a
+// model get an exact large cost instead of -log of an underflowed density. Output pointers may be null;
+// a model with both outputs null is not evaluated at all.
+template <unsigned int N, typename T>
+void evaluateGMMs(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const ColorN<N, T>* colors, unsigned int n,
+				  unsigned int* backComponent, unsigned int* foreComponent, T* backCost, T* foreCost);
+
+// The same for n colors already split into planes, channel k of color j at channels[k*channelStride + j]
+template <unsigned int N, typename T>
+void evaluateGMMs(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const T* channels, unsigned int channelStride,
+				  unsigned int n, unsigned int* backComponent, unsigned int* foreComponent, T* backCost, T* foreCost);
+
+// The same steps over groups of pixels known only by their sums, e.g. superpixels, in place of an image.
+// Every group counts as all of its pixels, which share one component; hardSegmentation and components
+// hold a bit and a byte per group, in one row. buildGMMs clusters the groups of each segment by weighted
+// k-means, as the bins of InitHistogramKMeans. learnGMMs assigns every group the component its pixels
+// are most likely under (unless assignComponents is false) and refits each Gaussian from the summed
+// groups of its component.
+template <unsigned int N, typename T>
+void buildGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const std::vector<GaussianFitterN<N, T> >& groups,
+			   const SegmentationImage& hardSegmentation);
+template <unsigned int N, typename T>
+void learnGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, Image<unsigned char>& components, const std::vector<GaussianFitterN<N, T> >& groups,
+			   const SegmentationImage& hardSegmentation, bool assignComponents = true);
+
+// Data costs of n groups of pixels, and the component each group is most likely under, as evaluateGMMs
+// does for colors. The summed -log p of a group's pixels has no closed form; the cost is its tightest
+// upper bound with mixture weights shared by the whole group, exact for a single pixel.
+template <unsigned int N, typename T>
+void evaluateGMMs(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, const GaussianFitterN<N, T>* groups, unsigned int n,
+				  unsigned int* backComponent, unsigned int* foreComponent, T* backCost, T* foreCost);
+
+// Merge components of the GMMs, down to their minK, as long as a merge lowers the Bayesian information
+// criterion computed from the sums of the statistics (which must be current, i.e. learnGMMs just used
+// them). Returns whether K changed; the statistics and any component assignment are then stale.
+template <unsigned int N, typename T>
+bool reduceGMMs(GMMN<N, T>& backgroundGMM, GMMN<N, T>& foregroundGMM, const GMMStatisticsN<N, T>& statistics);
+
+template <unsigned int N, typename T>
+class GMMN
 {
 public:
 
 	// Initialize GMM with number of gaussians desired.
-	GMM(unsigned int K);
-	~GMM();
+	GMMN(unsigned int K, CovarianceModel model = CovarianceFull);
+	~GMMN();
+
+	// Copy the gaussians and settings of another GMM, taking its capacity
+	GMMN(const GMMN<N, T>& gmm);
+	GMMN<N, T>& operator=(const GMMN<N, T>& gmm);
 
 	unsigned int K() const { return m_K; }
 
+	// Adaptive number of gaussians. With minK below the capacity (the K the GMM was created with),
+	// buildGMMs and reduceGMMs choose K between the two by the Bayesian information criterion. By
+	// default minK equals the capacity and K is fixed.
+	unsigned int capacity() const { return m_capacity; }
+	unsigned int minK() const { return m_minK; }
+	void setMinK(unsigned int minK) { m_minK = minK < 1 ? 1 : (minK > m_capacity ? m_capacity : minK); }
+
+	// Covariance model used the next time the GMM is built or learnt
+	CovarianceModel covarianceModel() const { return m_covarianceModel; }
+	void setCovarianceModel(CovarianceModel model) { m_covarianceModel = model; }
+
+	const GaussianN<N, T>& gaussian(unsigned int i) const { return m_gaussians[i]; }
+
 	// Returns the probability density of color c in this GMM
-	Real p(Color c);
+	T p(ColorN<N, T> c);
 
 	// Returns the probability density of color c in just Gaussian k
-	Real p(unsigned int i, Color c);
+	T p(unsigned int i, ColorN<N, T> c);
+
+	// Batch versions of the above for a block of n colors. componentDensities writes K planes of n
+	// values, plane i holding the density of Gaussian i (its log when logDomain is set, pi not applied).
+	// p writes the mixture density of every color, or -log of it when negLog is set.
+	void componentDensities(const ColorN<N, T>* colors, unsigned int n, T* planes, bool logDomain = false) const;
+	void p(const ColorN<N, T>* colors, unsigned int n, T* result, bool negLog = false) const;
+
+private:
+
+	unsigned int m_K;			// number of gaussians
+	GaussianN<N, T>* m_gaussians;	// an array of K gaussians (capacity allocated)
+
+	unsigned int m_capacity, m_minK;
+
+	CovarianceModel m_covarianceModel;
+
+	template <unsigned int M, typename U, typename S>
+	friend void buildGMMs(GMMN<M, U>& backgroundGMM, GMMN<M, U>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<M, S> >& image, const SegmentationImage& hardSegmentation,
+						  const FitSampler* sampler, GMMInitialization initialization);
+	template <unsigned int M, typename U, typename S>
+	friend void learnGMMs(GMMN<M, U>& backgroundGMM, GMMN<M, U>& foregroundGMM, Image<unsigned char>& components, const Image<ColorN<M, S> >& image, const SegmentationImage& hardSegmentation,
+						  bool assignComponents, GMMStatisticsN<M, U>* statistics, const FitSampler* sampler);
+	template <unsigned int M, typename U>
+	friend void evaluateGMMs(const GMMN<M, U>& backgroundGMM, const GMMN<M, U>& foregroundGMM, const ColorN<M, U>* colors, unsigned int n,
+							 unsigned int* backComponent, unsigned int* foreComponent, U* backCost, U* foreCost);
+	template <unsigned int M, typename U>
+	friend void evaluateGMMs(const GMMN<M, U>& backgroundGMM, const GMMN<M, U>& foregroundGMM, const U* channels, unsigned int channelStride,
+							 unsigned int n, unsigned int* backComponent, unsigned int* foreComponent, U* backCost, U* foreCost);
+	template <unsigned int M, typename U>
+	friend void componentDensities(const GMMN<M, U>& backgroundGMM, const GMMN<M, U>& foregroundGMM, const ColorN<M, U>* colors, unsigned int n,
+								   U* backPlanes, U* forePlanes, bool logDomain);
+	template <unsigned int M, typename U>
+	friend bool reduceGMMs(GMMN<M, U>& backgroundGMM, GMMN<M, U>& foregroundGMM, const GMMStatisticsN<M, U>& statistics);
+	template <unsigned int M, typename U>
+	friend void buildGMMs(GMMN<M, U>& backgroundGMM, GMMN<M, U>& foregroundGMM, Image<unsigned char>& components, const std::vector<GaussianFitterN<M, U> >& groups,
+						  const SegmentationImage& hardSegmentation);
+	template <unsigned int M, typename U>
+	friend void learnGMMs(GMMN<M, U>& backgroundGMM, GMMN<M, U>& foregroundGMM, Image<unsigned char>& components, const std::vector<GaussianFitterN<M, U> >& groups,
+						  const SegmentationImage& hardSegmentation, bool assignComponents);
+};
+
+// How the pixels the GMMs are fit to are chosen. SamplingAll fits every pixel. The other modes fit at
+// most about maxSamples pixels per model, one from every cell of a square grid whose size follows from
+// the number of pixels in the segment: the cell center (stratified) or a pseudo-random pixel of the cell
+// (jittered, fixed per cell so the samples stay put between iterations). Fitting cost then no longer
+// grows with the image size, while likelihoods and component assignment still cover every pixel.
+enum SamplingMode { SamplingAll, SamplingStratified, SamplingJittered };
+
+class FitSampler
+{
+public:
+	FitSampler(SamplingMode mode = SamplingAll, unsigned int maxSamples = 0);
+
+	SamplingMode mode() const { return m_mode; }
+
+	// Choose the grid size of each model from the current segmentation
+	void update(const SegmentationImage& hardSegmentation);
+
+	bool isSample(unsigned int x, unsigned int y, SegmentationValue segment) const
+	{
+		unsigned int stride = segment == SegmentationForeground ? m_foreStride : m_backStride;
+		if (stride == 1)
+			return true;
+
+		unsigned int ox = stride/2, oy = stride/2;
+		if (m_mode == SamplingJittered)
+		{
+			unsigned int hash = ((x/stride) * 73856093u) ^ ((y/stride) * 19349663u);
+			hash ^= hash >> 13;
+			hash *= 0x5bd1e995u;
+			hash ^= hash >> 15;
+			ox = hash % stride;
+			oy = (hash / stride) % stride;
+		}
+
+		return x % stride == ox && y % stride == oy;
+	}
+
+private:
+
+	SamplingMode m_mode;
+	unsigned int m_maxSamples;
+	unsigned int m_backStride, m_foreStride;
+};
+
+// Lookup table of the data costs -log p and the most likely components of both GMMs over the color cube
+// quantized to 2^bits levels per channel (2^(N*bits) cells), evaluated at the cell centers. Colors are expected in [0,1]
+// as produced by the image loader; values outside are clamped to the border cells.
+// Along with each cell, an upper bound on the difference between the table cost and the exact cost of
+// any color in that cell is stored. It follows from the gradient of -log p being a convex combination of
+// the per-Gaussian gradients inv(covariance)*(c-mu), bounded by the Frobenius norm of the inverse times
+// the largest distance of the cell to the mean, over half the cell diagonal.
+template <unsigned int N, typename T = Real>
+class GMMColorTableN
+{
+public:
+	GMMColorTableN(unsigned int bits);
+
+	unsigned int bits() const { return m_bits; }
+
+	// Evaluate both models at every cell center
+	void build(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM);
+
+	unsigned int index(const ColorN<N, T>& c) const
+	{
+		unsigned int i = 0;
+		for (unsigned int k = 0; k < N; k++)
+			i = (i << m_bits) | quantize(c[k]);
+		return i;
+	}
+
+	T backCost(unsigned int i) const				{ return m_backCost[i]; }
+	T foreCost(unsigned int i) const				{ return m_foreCost[i]; }
+	unsigned int backComponent(unsigned int i) const	{ return m_backComponent[i]; }
+	unsigned int foreComponent(unsigned int i) const	{ return m_foreComponent[i]; }
+
+	// Bound on |table cost - exact cost| for either model over all colors of cell i
+	T errorBound(unsigned int i) const				{ return m_errorBound[i]; }
 
 private:
 
-	unsigned int m_K;		// number of gaussians
-	Gaussian* m_gaussians;	// an array of K gaussians
+	unsigned int quantize(T v) const
+	{
+		int q = (int)(v * m_levels);
+		return q < 0 ? 0 : (q >= (int)m_levels ? m_levels-1 : q);
+	}
+
+	T cellErrorBound(const GMMN<N, T>& gmm, const ColorN<N, T>& center) const;
 
-	friend void buildGMMs(GMM& backgroundGMM, GMM& foregroundGMM, Image<unsigned int>& components, const Image<Color>& image, const Image<SegmentationValue>& hardSegmentation);
-	friend void learnGMMs(GMM& backgroundGMM, GMM& foregroundGMM, Image<unsigned int>& components, const Image<Color>& image, const Image<SegmentationValue>& hardSegmentation);
+	unsigned int m_bits, m_levels;
+
+	std::vector<T> m_backCost, m_foreCost, m_errorBound;
+	std::vector<unsigned char> m_backComponent, m_foreComponent;
 };
 
-// Build the initial GMMs using the Orchard and Bouman color clustering algorithm
-void buildGMMs(GMM& backgroundGMM, GMM& foregroundGMM, Image<unsigned int>& components, const Image<Color>& image, const Image<SegmentationValue>& hardSegmentation);
+// Bound on how far the data costs and component log-densities of a GMM pair have moved since they were
+// last evaluated, kept per cell of the color cube quantized to 2^bits levels per channel. The change of
+// -log p of a mixture is at most the largest change of its components' log(pi N), which is a quadratic
+// in the color, bounded over a cell from its value and gradient at the center and the Frobenius norm of
+// its Hessian. Drift accumulates per cell over GMM updates until it exceeds the tolerance, at which
+// point the cell is stale and its pixels must be evaluated again.
+template <unsigned int N, typename T = Real>
+class GMMDriftBoundN
+{
+public:
+	GMMDriftBoundN(unsigned int bits = 15/N);	// about 2^15 cells by default
+
+	unsigned int index(const ColorN<N, T>& c) const
+	{
+		unsigned int i = 0;
+		for (unsigned int k = 0; k < N; k++)
+			i = (i << m_bits) | quantize(c[k]);
+		return i;
+	}
+
+	// Mark every cell stale, e.g. when the evaluated pixels or the GMMs changed wholesale
+	void reset() { m_valid = false; }
+
+	// Accumulate the drift from the GMMs of the previous update to these, and mark the cells whose drift
+	// exceeds tolerance as stale. The caller must evaluate the pixels of all stale cells before the next
+	// update, whose drift starts from zero again for them. A change of K makes every cell stale.
+	void update(const GMMN<N, T>& backgroundGMM, const GMMN<N, T>& foregroundGMM, T tolerance);
+
+	bool backStale(unsigned int i) const	{ return m_backStale[i] != 0; }
+	bool foreStale(unsigned int i) const	{ return m_foreStale[i] != 0; }
+
+private:
+
+	unsigned int quantize(T v) const
+	{
+		int q = (int)(v * m_levels);
+		return q < 0 ? 0 : (q >= (int)m_levels ? m_levels-1 : q);
+	}
+
+	void update(const GMMN<N, T>& gmm, std::vector<GaussianN<N, T> >& previous, std::vector<T>& drift, std::vector<unsigned char>& stale, T tolerance);
 
-// Iteratively learn GMMs using GrabCut updating algorithm
-void learnGMMs(GMM& backgroundGMM, GMM& foregroundGMM, Image<unsigned int>& components, const Image<Color>& image, const Image<SegmentationValue>& hardSegmentation);
+	unsigned int m_bits, m_levels;
+	bool m_valid;
 
+	std::vector<GaussianN<N, T> > m_backPrevious, m_forePrevious;
+	std::vector<T> m_backDrift, m_foreDrift;
+	std::vector<unsigned char> m_backStale, m_foreStale;
+};
 
 // Helper class that fits a single Gaussian to color samples
-class GaussianFitter
+template <unsigned int N, typename T>
+class GaussianFitterN
 {
 public:
-	GaussianFitter();
+	GaussianFitterN();
 	
 	// Add a color sample
-	void add(Color c);
+	void add(ColorN<N, T> c);
+
+	// Remove a color sample that was added before
+	void remove(ColorN<N, T> c);
+
+	// Add or remove all the samples of another fitter, used to merge partial sums
+	void add(const GaussianFitterN<N, T>& other);
+	void remove(const GaussianFitterN<N, T>& other);
+
+	unsigned int samples() const { return count; }
+
+	// Mean of the added color samples
+	ColorN<N, T> mean() const
+	{
+		ColorN<N, T> result;
+		for (unsigned int i = 0; i < N; i++)
+			result[i] = (T)(s[i]/count);
+		return result;
+	}
 	
-	// Build the gaussian out of all the added color samples
-	void finalize(Gaussian& g, unsigned int totalCount, bool computeEigens = false) const;
+	// Sum over the added samples of their squared Mahalanobis distance to Gaussian g, from the sums alone
+	double mahalanobis(const GaussianN<N, T>& g) const;
+
+	// Build the gaussian out of all the added color samples. The covariance is reduced to the given
+	// model; CovarianceTied is fit as full here and shared afterwards by the caller.
+	void finalize(GaussianN<N, T>& g, unsigned int totalCount, bool computeEigens = false, CovarianceModel model = CovarianceFull) const;
 	
 private:
 
-	Color s;			// sum of r,g, and b
-	Real  p[3][3];		// matrix of products (i.e. r*r, r*g, r*b), some values are duplicated.
+	// Sums are kept in double: they run over millions of pixels, and with incremental updates samples
+	// are removed again, so float accumulation would drift.
+	double s[N];		// sum of each channel (r,g, and b)
+	double p[N][N];		// matrix of products (i.e. r*r, r*g, r*b), some values are duplicated.
 
 	unsigned int count;	// count of color samples added to the gaussian
 };
+
+// Persistent per-component sufficient statistics of a background/foreground GMM pair. Remembers the
+// (segmentation, component) bucket each pixel's color was added to, so that an update only subtracts
+// and re-adds the pixels whose bucket changed since the last one.
+template <unsigned int N, typename T>
+class GMMStatisticsN
+{
+public:
+	GMMStatisticsN(unsigned int width, unsigned int height, unsigned int backK, unsigned int foreK);
+	~GMMStatisticsN();
+
+	// Forget all samples, the next update adds every pixel
+	void reset();
+
+	// Bring the sums in line with the current assignment, of the sampled pixels only if a sampler is
+	// given. Returns the number of pixels moved.
+	template <typename S>
+	unsigned int update(const Image<unsigned char>& components, const Image<ColorN<N, S> >& image, const SegmentationImage& hardSegmentation,
+						const FitSampler* sampler = 0);
+
+	const GaussianFitterN<N, T>& backFitter(unsigned int i) const	{ return m_backFitters[i]; }
+	const GaussianFitterN<N, T>& foreFitter(unsigned int i) const	{ return m_foreFitters[i]; }
+	unsigned int backCount() const	{ return m_backCount; }
+	unsigned int foreCount() const	{ return m_foreCount; }
+
+private:
+
+	// Bucket encoding: the component index, with the high bit set for foreground
+	enum { ForegroundBucket = 0x80, NoBucket = 0xff };
+
+	Image<unsigned char> m_bucket;
+
+	unsigned int m_backK, m_foreK;
+	GaussianFitterN<N, T> *m_backFitters, *m_foreFitters;
+	unsigned int m_backCount, m_foreCount;
+};
+
+// The RGB instances in the default precision, used throughout
+typedef GaussianN<3> Gaussian;
+typedef GMMN<3> GMM;
+typedef GaussianFitterN<3> GaussianFitter;
+typedef GMMStatisticsN<3> GMMStatistics;
+typedef GMMColorTableN<3> GMMColorTable;
+typedef GMMDriftBoundN<3> GMMDriftBound;
 }
 #endif //GMM_H
\ No newline at end of file
@@ -15,17 +15,12 @@
 #include <math.h>
 #include <vector>
 
-// Choose accuracy of computations (double doesn't seem to work for me yet.)
-//#define USE_DOUBLE
-
 namespace GrabCutNS 
 {
 
-#ifdef USE_DOUBLE
-	typedef double Real;
-#else
-	typedef float Real;
-#endif
+// Default accuracy of computations. The color, GMM and GrabCut templates take the precision as a
+// parameter, so double precision engines (e.g. GrabCutN<3, double>) can be used next to this one.
+typedef float Real;
 
 
 // User supplied Trimap values
@@ -34,16 +29,39 @@ enum TrimapValue { TrimapUnknown, TrimapForeground, TrimapBackground };
 // Grabcut derived hard segementation values
 enum SegmentationValue { SegmentationForeground, SegmentationBackground };
 
-// Storage for N-link weights, each pixel stores links to only four of its 8-neighborhood neighbors.
-// This avoids duplication of links, while still allowing for relatively easy lookup.
-struct NLinks
+// Neighborhoods of the graph, the compile-time connectivity policy of GrabCutN. Each pixel stores the
+// links to only the half of its neighbors that follow it, in the next rows or to its right, one plane
+// of N-link weights per direction. This avoids duplication of links, while still allowing for relatively
+// easy lookup. Direction d leads to the neighbor (x+dx(d), y+dy(d)), at most Reach pixels away.
+struct Neighborhood4
+{
+	enum { Directions = 2, Reach = 1 };
+
+	static int dx(unsigned int d) { return d == 0 ? 0 : 1; }		// up, right
+	static int dy(unsigned int d) { return d == 0 ? 1 : 0; }
+};
+
+struct Neighborhood8
 {
-	Real upleft;
-	Real up;
-	Real upright;
-	Real right;
+	enum { Directions = 4, Reach = 1 };
+
+	static int dx(unsigned int d) { static const int v[Directions] = { -1, 0, 1, 1 }; return v[d]; }	// upleft, up, upright, right
+	static int dy(unsigned int d) { static const int v[Directions] = { 1, 1, 1, 0 }; return v[d]; }
+};
+
+// The 8-neighborhood plus the knight's moves, for boundaries closer to the Euclidean length
+struct Neighborhood16
+{
+	enum { Directions = 8, Reach = 2 };
+
+	static int dx(unsigned int d) { static const int v[Directions] = { -1, 0, 1, 1, -2, -1, 1, 2 }; return v[d]; }
+	static int dy(unsigned int d) { static const int v[Directions] = { 1, 1, 1, 0, 1, 2, 2, 1 }; return v[d]; }
 };
 
+// How the N-link weights are kept between graph builds: as Real, quantized to 16 or 8 bit levels of a
+// shared scale, or not at all, recomputed from the colors every time the graph is built.
+enum NLinkStorage { NLinksReal, NLinks16Bit, NLinks8Bit, NLinksOnTheFly };
+
 
 // Helper function, finds distance between two pixels
 inline Real distance(unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2)
@@ -7,53 +7,162 @@
  */
 
 #include "GrabCut.h" 
-#include <conio.h>
+#include "Superpixels.h"
+#include <algorithm>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
 
 namespace GrabCutNS {
 
-GrabCut::GrabCut( Image<Color>* image )
+// Wall-clock seconds from an arbitrary origin
+static double wallClock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / frequency.QuadPart;
+#else
+	timeval t;
+	gettimeofday(&t, 0);
+	return t.tv_sec + t.tv_usec*1e-6;
+#endif
+}
+
+// Whether a criterion stops a refinement before its next iteration, given the iterations so far, the
+// seconds since it started and those the last iteration took, and which (the first always runs)
+static bool stopsBefore(const RefineCriteria& criteria, unsigned int iterations, double elapsed, double duration, RefineStop& stop)
+{
+	if (criteria.maxIterations && iterations >= criteria.maxIterations)
+		stop = RefineMaxIterations;
+	else if (criteria.seconds > 0 && iterations && elapsed + duration > criteria.seconds)
+		stop = RefineDeadline;
+	else
+		return false;
+
+	return true;
+}
+
+// Whether a criterion stops it after an iteration that changed changed of its total labels, taking the
+// energy from last (unless it was the first) to energy, and which
+static bool stopsAfter(const RefineCriteria& criteria, unsigned int iterations, int changed, unsigned int total, double last, double energy, RefineStop& stop)
+{
+	if (!changed)
+		stop = RefineConverged;
+	else if (criteria.changedFraction > 0 && changed <= criteria.changedFraction*total)
+		stop = RefineChanged;
+	else if (criteria.energyDecrease > 0 && iterations > 1 && last - energy < criteria.energyDecrease*fabs(last))
+		stop = RefineEnergy;
+	else
+		return false;
+
+	return true;
+}
+
+// Gather pixels xs[0..n) of row y from the channel planes into out, channel k at out + k*stride
+template <typename T, typename S>
+static inline void gatherChannels(const PlanarImage<S>& channels, unsigned int y, const unsigned int* xs, unsigned int n, T* out, unsigned int stride)
+{
+	for (unsigned int k = 0; k < channels.planes(); k++)
+	{
+		const S* c = channels.row(k, y);
+		T* o = out + k*stride;
+		for (unsigned int j = 0; j < n; ++j)
+			o[j] = level<T>(c[xs[j]]);
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+GrabCutN<N, T, S, C>::GrabCutN( const Image<ColorN<N, S> >* image )
 {
 	m_image = image;
 
 	m_w = m_image->width();
 	m_h = m_image->height();
 
-	m_trimap = new Image<TrimapValue>( m_w, m_h );
+	m_channels = new PlanarImage<S>( m_w, m_h, N );
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const ColorN<N, S>* colors = m_image->row(y);
+		for (unsigned int k = 0; k < N; k++)
+		{
+			S* channel = m_channels->row(k, y);
+			for (unsigned int x = 0; x < m_w; ++x)
+				channel[x] = colors[x][k];
+		}
+	}
+
+	m_trimap = new Image<unsigned char>( m_w, m_h );
 	m_trimap->fill(TrimapUnknown);
 
-	m_GMMcomponent = new Image<unsigned int>( m_w, m_h );
+	m_GMMcomponent = new Image<unsigned char>( m_w, m_h );
 
-	m_hardSegmentation = new Image<SegmentationValue>( m_w, m_h );
-	m_hardSegmentation->fill(SegmentationBackground);
+	m_hardSegmentation = new SegmentationImage( m_w, m_h );
 
 	m_softSegmentation = 0;		// Not yet implemented
 
 	m_TLinksImage = new Image<Color>(m_w, m_h);
 	m_TLinksImage->fill(Color(0,0,0));
-	m_NLinksImage = new Image<Real>(m_w, m_h);
+	m_NLinksImage = new Image<Real>(m_w, m_h, C::Reach);
 	m_NLinksImage->fill(0);
 	m_GMMImage = new Image<Color>(m_w, m_h);
 	m_GMMImage->fill(Color(0,0,0));
 	m_AlphaImage = new Image<Real>(m_w, m_h);
 	m_AlphaImage->fill(0);
 
-	m_foregroundGMM = new GMM(5);
-	m_backgroundGMM = new GMM(5);
+	m_foregroundGMM = new GMMN<N, T>(5);
+	m_backgroundGMM = new GMMN<N, T>(5);
+	m_GMMStatistics = new GMMStatisticsN<N, T>( m_w, m_h, m_backgroundGMM->capacity(), m_foregroundGMM->capacity() );
+	m_initialization = InitOrchardBouman;
+
+	m_foreComponent = new Image<unsigned char>( m_w, m_h );
+	m_backComponent = new Image<unsigned char>( m_w, m_h );
+	m_componentsValid = false;
+
+	m_backCost = new Image<T>( m_w, m_h );
+	m_foreCost = new Image<T>( m_w, m_h );
+	m_driftBound = 0;
+	m_lazyTolerance = 0;
+
+	m_colorTable = 0;
+	m_colorTableValid = false;
+
+	m_superpixelSize = 0;
+	m_regions = 0;
+	m_regionCount = 0;
+
+	m_freezeIterations = 0;
+	m_freezeDistance = 0;
+	m_stable = 0;
+	m_activeTrimap = 0;
+	m_frozen = 0;
 
 	//set some constants
 	m_lambda = 50;
 	computeL();
 	computeBeta();
 	
-	m_NLinks = new Image<NLinks>( m_w, m_h );
+	m_NLinkStorage = NLinksReal;
+	m_NLinks = 0;
+	m_NLinks16 = 0;
+	m_NLinks8 = 0;
 	computeNLinks();
 
 	m_graph = 0;
 	m_nodes = new Image<Graph::node_id>( m_w, m_h );
 }
 
-GrabCut::~GrabCut()
+template <unsigned int N, typename T, typename S, typename C>
+GrabCutN<N, T, S, C>::~GrabCutN()
 {
+	if (m_channels)
+		delete m_channels;
 	if (m_trimap)
 		delete m_trimap;
 	if (m_GMMcomponent)
@@ -66,8 +175,32 @@ GrabCut::~GrabCut()
 		delete m_foregroundGMM;
 	if (m_backgroundGMM)
 		delete m_backgroundGMM;
+	if (m_GMMStatistics)
+		delete m_GMMStatistics;
+	if (m_foreComponent)
+		delete m_foreComponent;
+	if (m_backComponent)
+		delete m_backComponent;
+	if (m_backCost)
+		delete m_backCost;
+	if (m_foreCost)
+		delete m_foreCost;
+	if (m_driftBound)
+		delete m_driftBound;
+	if (m_colorTable)
+		delete m_colorTable;
+	if (m_regions)
+		delete m_regions;
+	if (m_stable)
+		delete m_stable;
+	if (m_activeTrimap)
+		delete m_activeTrimap;
 	if (m_NLinks)
 		delete m_NLinks;
+	if (m_NLinks16)
+		delete m_NLinks16;
+	if (m_NLinks8)
+		delete m_NLinks8;
 	if (m_nodes)
 		delete m_nodes;
 	if (m_TLinksImage)
@@ -81,56 +214,138 @@ GrabCut::~GrabCut()
 }
 
 
-void GrabCut::initialize(unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2)
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::initialize(unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2)
 {
 	// Step 1: User creates inital Trimap with rectangle, Background outside, Unknown inside
 	m_trimap->fill(TrimapBackground);
 	m_trimap->fillRectangle(x1, y1, x2, y2, TrimapUnknown);
   
 	// Step 2: Initial segmentation, Background where Trimap is Background, Foreground where Trimap is Unknown.
-	m_hardSegmentation->fill(SegmentationBackground);
-	m_hardSegmentation->fillRectangle(x1, y1, x2, y2, SegmentationForeground);
+	m_hardSegmentation->fill(false);
+	m_hardSegmentation->fillRectangle(x1, y1, x2, y2, true);
+
+	m_componentsValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+	if (m_stable)
+		m_stable->fill(0);
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::initializeWithMask(Image<Color>* mask) {
+	Image<unsigned char> selected( mask->width(), mask->height() );
+	for(unsigned int y=0;y<mask->height();y++) {
+		const Color* m = mask->row(y);
+		unsigned char* s = selected.row(y);
+		for(unsigned int x=0;x<mask->width();x++)
+			s[x] = m[x].b > 0.0 || m[x].g > 0.0 || m[x].r > 0.0;
+	}
+
+	initializeWithMask(&selected);
 }
 
-void GrabCut::initializeWithMask(Image<Color>* mask) {
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::initializeWithMask(Image<unsigned char>* mask) {
 	m_trimap->fill(TrimapBackground);
-	m_hardSegmentation->fill(SegmentationBackground);
-	for(unsigned int x=0;x<mask->width();x++) {
-		for(unsigned int y=0;y<mask->height();y++) {
-			if((*mask)(x,y).b > 0.0 || (*mask)(x,y).g > 0.0 || (*mask)(x,y).r > 0.0) {
-				(*m_trimap)(x,y) = TrimapUnknown;
-				(*m_hardSegmentation)(x,y) = SegmentationForeground;
+	m_hardSegmentation->fill(false);
+	for(unsigned int y=0;y<mask->height() && y<m_h;y++) {
+		const unsigned char* m = mask->row(y);
+		unsigned char* trimap = m_trimap->row(y);
+		BitWord* segmentation = m_hardSegmentation->row(y);
+		for(unsigned int x=0;x<mask->width() && x<m_w;x++) {
+			if(m[x]) {
+				trimap[x] = TrimapUnknown;
+				BitImage::setBit(segmentation, x, true);
 			}
 		}
 	}
+
+	m_componentsValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+	if (m_stable)
+		m_stable->fill(0);
 }
 
-void GrabCut::fitGMMs()
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::fitGMMs()
 {
+	const FitSampler* sampler = 0;
+	if (m_sampler.mode() != SamplingAll)
+	{
+		m_sampler.update(*m_hardSegmentation);
+		sampler = &m_sampler;
+	}
+
 	// Step 3: Build GMMs using Orchard-Bouman clustering algorithm
-	buildGMMs(*m_backgroundGMM, *m_foregroundGMM, *m_GMMcomponent, *m_image, *m_hardSegmentation);
+	buildGMMs(*m_backgroundGMM, *m_foregroundGMM, *m_GMMcomponent, *m_image, *m_hardSegmentation, sampler, m_initialization);
+	m_GMMStatistics->reset();
+	m_colorTableValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+	if (m_stable)
+		m_stable->fill(0);
 
 	// Initialize the graph for graphcut (do this here so that the T-Link debugging image will be initialized)
 	initGraph();
 
+	// Only the sampled pixels got a component from the clustering
+	if (sampler)
+		selectComponents();
+
 	// Build debugging images
 	buildImages();
 }
 
-int GrabCut::refineOnce()
+template <unsigned int N, typename T, typename S, typename C>
+int GrabCutN<N, T, S, C>::refineOnce(GibbsEnergy* energy)
 {
-	Real flow = 0;
+	T flow = 0;
+
+	const FitSampler* sampler = 0;
+	if (m_sampler.mode() != SamplingAll)
+	{
+		m_sampler.update(*m_hardSegmentation);
+		sampler = &m_sampler;
+	}
 
 	// Steps 4 and 5: Learn new GMMs from current segmentation
-	learnGMMs(*m_backgroundGMM, *m_foregroundGMM, *m_GMMcomponent, *m_image, *m_hardSegmentation);
+	if (m_componentsValid)
+	{
+		// Step 4 was done by the last initGraph
+		selectComponents();
+
+		learnGMMs(*m_backgroundGMM, *m_foregroundGMM, *m_GMMcomponent, *m_image, *m_hardSegmentation, false, m_GMMStatistics, sampler);
+	}
+	else
+	{
+		learnGMMs(*m_backgroundGMM, *m_foregroundGMM, *m_GMMcomponent, *m_image, *m_hardSegmentation, true, m_GMMStatistics, sampler);
+	}
+
+	// Merge components the segmentation no longer supports. The sums are kept per component, start over.
+	if (reduceGMMs(*m_backgroundGMM, *m_foregroundGMM, *m_GMMStatistics))
+		m_GMMStatistics->reset();
+	m_colorTableValid = false;
+
+	// Step 6: Run GraphCut and update segmentation, over the band of pixels that are not frozen
+	m_frozen = m_freezeIterations ? freezeStable() : 0;
+	if (m_frozen)
+		std::swap(m_trimap, m_activeTrimap);
 
-	// Step 6: Run GraphCut and update segmentation
 	initGraph();
 	if (m_graph)
 		flow = m_graph->maxflow();
 	
 	int changed = updateHardSegmentation();
-	printf("%d pixels changed segmentation (max flow = %f)\n", changed, flow ); 
+	if (m_frozen)
+		std::swap(m_trimap, m_activeTrimap);
+
+	if (energy)
+	{
+		computeEnergy(*energy);
+		energy->flow = flow;
+	}
 
 	// Build debugging images
 	buildImages();
@@ -138,240 +353,1445 @@ int GrabCut::refineOnce()
 	return changed;
 }
 
-void GrabCut::refine()
+template <unsigned int N, typename T, typename S, typename C>
+int GrabCutN<N, T, S, C>::cutUnbanded(T& flow)
 {
-	int changed = m_w*m_h;
+	// The frozen pixels only got the component of their segment and no t-links meanwhile, as trimap
+	// pixels, and are evaluated again for this cut
+	m_componentsValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+	m_frozen = 0;
+
+	initGraph();
+	flow = m_graph ? m_graph->maxflow() : 0;
+
+	int changed = updateHardSegmentation();
+
+	// Build debugging images
+	buildImages();
 
-	while (changed)
-		changed = refineOnce();
+	return changed;
 }
 
-int GrabCut::updateHardSegmentation()
+template <unsigned int N, typename T, typename S, typename C>
+RefineStop GrabCutN<N, T, S, C>::refine(const RefineCriteria& criteria, RefineResult* result)
 {
-	int changed = 0;
+	const double start = wallClock();
+	const bool tracking = criteria.energyDecrease > 0 || result;
+	GibbsEnergy energy, last;
+	unsigned int iterations = 0;
+	int mismatched = -1;
+	unsigned int frozen = 0;
+	double duration = 0;		// of the last iteration
+	bool checking = false;		// the banded cut converged, the next iteration checks it
+	RefineStop stop = RefineConverged;
 
-	for (unsigned int y = 0; y < m_h; ++y)
+	for (;;)
 	{
-		for (unsigned int x = 0; x < m_w; ++x)
-		{
-			SegmentationValue oldValue = (*m_hardSegmentation)(x,y);
+		if (stopsBefore(criteria, iterations, wallClock() - start, duration, stop))
+			break;
 
-			if ((*m_trimap)(x,y) == TrimapBackground)
-				(*m_hardSegmentation)(x,y) = SegmentationBackground;
-			else if ((*m_trimap)(x,y) == TrimapForeground)
-				(*m_hardSegmentation)(x,y) = SegmentationForeground;
-			else	// TrimapUnknown
+		if (checking)
+		{
+			T flow;
+			mismatched = cutUnbanded(flow);
+			iterations++;
+			if (tracking)
 			{
-				if (m_graph->what_segment((*m_nodes)(x,y)) == Graph::SOURCE)
-					(*m_hardSegmentation)(x,y) = SegmentationForeground;
-				else
-					(*m_hardSegmentation)(x,y) = SegmentationBackground;
+				computeEnergy(energy);
+				energy.flow = flow;
 			}
+			break;
+		}
 
-			if (oldValue != (*m_hardSegmentation)(x,y))
-				changed++;
+		double begin = wallClock();
+		int changed = refineOnce(tracking ? &energy : 0);
+		iterations++;
+		duration = wallClock() - begin;
+		frozen = m_frozen;
+
+		// Converged with pixels frozen: the same GMMs cut over every unknown pixel must agree. The check
+		// counts as an iteration, within the limits above.
+		if (!changed && m_frozen)
+		{
+			checking = true;
+			continue;
 		}
+		if (stopsAfter(criteria, iterations, changed, m_w*m_h, last.energy, energy.energy, stop))
+			break;
+		last = energy;
 	}
-	return changed;
-}
-
-void GrabCut::setTrimap(int x1, int y1, int x2, int y2, const TrimapValue& t)
-{
-	(*m_trimap).fillRectangle(x1, y1, x2, y2, t);
 
-	// Immediately set the segmentation as well so that the display will update.
-	if (t == TrimapForeground)
-		(*m_hardSegmentation).fillRectangle(x1, y1, x2, y2, SegmentationForeground);
-	else if (t == TrimapBackground)
-		(*m_hardSegmentation).fillRectangle(x1, y1, x2, y2, SegmentationBackground);
+	if (result)
+	{
+		result->stop = stop;
+		result->iterations = iterations;
+		result->energy = energy;
+		result->mismatched = mismatched;
+		result->frozen = frozen;
+	}
 
-	// Build debugging images
-	//buildImages();
+	return stop;
 }
 
-//private functions
-
-void GrabCut::initGraph()
+template <unsigned int N, typename T, typename S, typename C>
+RefineStop GrabCutN<N, T, S, C>::refinePyramid(unsigned int levels, unsigned int band, const RefineCriteria& criteria, RefineResult* result)
 {
-	// Set up the graph (it can only be used once, so we have to recreate it each time the graph is updated)
-	if (m_graph)
-		delete m_graph;
-	m_graph = new Graph();
+	if (!halvable(levels))
+		return refine(criteria, result);
 
-	for (unsigned int y = 0; y < m_h; ++y)
+	const double start = wallClock();
+	unsigned int w = (m_w+1)/2, h = (m_h+1)/2;
+
+	// Each coarse pixel averages its (up to) 2x2 fine pixels. A coarse trimap pixel keeps the value its
+	// fine pixels share and is unknown otherwise, a coarse pixel is foreground if at least half of its
+	// fine pixels are.
+	Image<ColorN<N, T> > image(w, h);
+	for (unsigned int y = 0; y < h; ++y)
 	{
-		for(unsigned int x = 0; x < m_w; ++x)
+		ColorN<N, T>* colors = image.row(y);
+		unsigned int rows = 2*y+1 < m_h ? 2 : 1;
+		const ColorN<N, S>* fine[2] = { m_image->row(2*y), m_image->row(2*y+rows-1) };
+
+		for (unsigned int x = 0; x < w; ++x)
 		{
-			(*m_nodes)(x,y) = m_graph->add_node();
+			unsigned int columns = 2*x+1 < m_w ? 2 : 1;
+			ColorN<N, T> sum = toColor<T>(fine[0][2*x]);
+			for (unsigned int i = 0; i < rows; ++i)
+			{
+				for (unsigned int j = (i ? 0 : 1); j < columns; ++j)
+				{
+					ColorN<N, T> c = toColor<T>(fine[i][2*x+j]);
+					for (unsigned int k = 0; k < N; k++)
+						sum[k] += c[k];
+				}
+			}
+			for (unsigned int k = 0; k < N; k++)
+				sum[k] /= rows*columns;
+			colors[x] = sum;
 		}
 	}
-	
-	// Set T-Link weights
-	for (unsigned int y = 0; y < m_h; ++y)
+
+	GrabCutN<N, T, T, C> coarse(&image);
+	coarse.setComponentRange(m_foregroundGMM->minK(), m_foregroundGMM->capacity());
+	coarse.setCovarianceModel(m_foregroundGMM->covarianceModel());
+	coarse.setColorTableBits(m_colorTable ? m_colorTable->bits() : 0);
+	coarse.setLazyTolerance(m_lazyTolerance);
+	coarse.setNLinkStorage(m_NLinkStorage);
+	coarse.setInitialization(m_initialization);
+	coarse.setBandFreezing(m_freezeIterations, m_freezeDistance);
+	coarse.m_sampler = m_sampler;
+
+	for (unsigned int y = 0; y < h; ++y)
 	{
-		for(unsigned int x = 0; x < m_w; ++x)
+		unsigned int rows = 2*y+1 < m_h ? 2 : 1;
+		unsigned char* trimap = coarse.m_trimap->row(y);
+		BitWord* segmentation = coarse.m_hardSegmentation->row(y);
+		const unsigned char* fineTrimap[2] = { m_trimap->row(2*y), m_trimap->row(2*y+rows-1) };
+		const BitWord* fineSegmentation[2] = { m_hardSegmentation->row(2*y), m_hardSegmentation->row(2*y+rows-1) };
+
+		for (unsigned int x = 0; x < w; ++x)
 		{
-			Real back, fore;
+			unsigned int columns = 2*x+1 < m_w ? 2 : 1;
+			unsigned char t = fineTrimap[0][2*x];
+			unsigned int foreground = 0;
 
-			if ((*m_trimap)(x,y) == TrimapUnknown )
-			{
-				fore = -log(m_backgroundGMM->p((*m_image)(x,y)));
-				back = -log(m_foregroundGMM->p((*m_image)(x,y)));
-			}
-			else if ((*m_trimap)(x,y) == TrimapBackground )
-			{
-				fore = 0;
-				back = m_L;
-			}
-			else		// TrimapForeground
+			for (unsigned int i = 0; i < rows; ++i)
 			{
-				fore = m_L;
-				back = 0;
+				for (unsigned int j = 0; j < columns; ++j)
+				{
+					if (fineTrimap[i][2*x+j] != t)
+						t = TrimapUnknown;
+					foreground += BitImage::bit(fineSegmentation[i], 2*x+j);
+				}
 			}
 
-			m_graph->set_tweights((*m_nodes)(x,y), fore, back);
-
-			(*m_TLinksImage)(x,y).r = pow((Real)fore/m_L, (Real)0.25);
-			(*m_TLinksImage)(x,y).g = pow((Real)back/m_L, (Real)0.25);
+			trimap[x] = t;
+			BitImage::setBit(segmentation, x, 2*foreground >= rows*columns);
 		}
 	}
 
-	// Set N-Link weights from precomputed values
+	// Only the coarsest level is fit from scratch, the others take the GMMs of the level below
+	if (!coarse.halvable(levels-1))
+		coarse.fitGMMs();
+	RefineResult coarseResult;
+	RefineStop stop = coarse.refinePyramid(levels-1, band, criteria, &coarseResult);
+
+	// Bring the segmentation and GMMs up, the fixed pixels keep their segment
 	for (unsigned int y = 0; y < m_h; ++y)
 	{
+		const unsigned char* trimap = m_trimap->row(y);
+		const BitWord* coarseSegmentation = coarse.m_hardSegmentation->row(y/2);
+		BitWord* segmentation = m_hardSegmentation->row(y);
+
 		for (unsigned int x = 0; x < m_w; ++x)
 		{
-			if( x > 0 && y < m_h-1 )
-				m_graph->add_edge((*m_nodes)(x,y), (*m_nodes)(x-1,y+1), (*m_NLinks)(x,y).upleft, (*m_NLinks)(x,y).upleft);
+			if (trimap[x] == TrimapUnknown)
+				BitImage::setBit(segmentation, x, BitImage::bit(coarseSegmentation, x/2));
+		}
+	}
 
-			if( y < m_h-1 )
-				m_graph->add_edge((*m_nodes)(x,y), (*m_nodes)(x,y+1), (*m_NLinks)(x,y).up, (*m_NLinks)(x,y).up);
+	*m_backgroundGMM = *coarse.m_backgroundGMM;
+	*m_foregroundGMM = *coarse.m_foregroundGMM;
 
-			if( x < m_w-1 && y < m_h-1 )
-				m_graph->add_edge((*m_nodes)(x,y), (*m_nodes)(x+1,y+1), (*m_NLinks)(x,y).upright, (*m_NLinks)(x,y).upright);
+	// This level gets what is left of the time, and iterations of its own
+	RefineCriteria remaining = criteria;
+	if (criteria.seconds > 0)
+		remaining.seconds = criteria.seconds - (wallClock() - start);
 
-			if( x < m_w-1 )
-				m_graph->add_edge((*m_nodes)(x,y), (*m_nodes)(x+1,y), (*m_NLinks)(x,y).right, (*m_NLinks)(x,y).right);
-		}
+	if (stop != RefineDeadline && (criteria.seconds <= 0 || remaining.seconds > 0))
+	{
+		stop = refineBand(band, remaining, result);
+		if (result)
+			result->iterations += coarseResult.iterations;
 	}
-}
-
-void GrabCut::computeNLinks()
-{
-	for( unsigned int y = 0; y < m_h; ++y )
+	else
 	{
-		for( unsigned int x = 0; x < m_w; ++x )
+		stop = RefineDeadline;
+		if (result)
 		{
-			if( x > 0 && y < m_h-1 )
-				(*m_NLinks)(x,y).upleft = computeNLink( x, y, x-1, y+1 );
-				
-			if( y < m_h-1 )
-				(*m_NLinks)(x,y).up = computeNLink( x, y, x, y+1 );
-				
-			if( x < m_w-1 && y < m_h-1 )
-				(*m_NLinks)(x,y).upright = computeNLink( x, y, x+1, y+1 );
-				
-			if( x < m_w-1 )
-				(*m_NLinks)(x,y).right = computeNLink( x, y, x+1, y );
+			*result = coarseResult;
+			result->stop = stop;
 		}
+
+		m_GMMStatistics->reset();
+		m_componentsValid = false;
+		m_colorTableValid = false;
+		if (m_driftBound)
+			m_driftBound->reset();
+		if (m_stable)
+			m_stable->fill(0);
+
+		buildImages();
 	}
+
+	return stop;
 }
 
-Real GrabCut::computeNLink(unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2)
+template <unsigned int N, typename T, typename S, typename C>
+RefineStop GrabCutN<N, T, S, C>::refineBand(unsigned int band, const RefineCriteria& criteria, RefineResult* result)
 {
-	return m_lambda * exp( -m_beta * distance2((*m_image)(x1,y1),(*m_image)(x2,y2)) ) / distance(x1,y1,x2,y2);
+	// The cached components and costs do not cover the pixels fixed for the band
+	Image<unsigned char>* trimap = new Image<unsigned char>( m_w, m_h );
+	bandTrimap(band, *trimap);
+	std::swap(trimap, m_trimap);
+
+	m_GMMStatistics->reset();
+	m_componentsValid = false;
+	m_colorTableValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+	if (m_stable)
+		m_stable->fill(0);
+
+	RefineStop stop = refine(criteria, result);
+
+	std::swap(trimap, m_trimap);
+	delete trimap;
+
+	m_componentsValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+
+	return stop;
 }
 
-void GrabCut::computeBeta()
+template <unsigned int N, typename T, typename S, typename C>
+RefineStop GrabCutN<N, T, S, C>::refineSuperpixels(unsigned int size, unsigned int band, const RefineCriteria& criteria, RefineResult* result)
 {
-	Real result = 0;
-	int edges = 0;
+	const double start = wallClock();
+
+	if (!m_regions || size != m_superpixelSize)
+		computeRegions(size);
 
+	const unsigned int R = m_regionCount;
+
+	// A region is fixed if any of its pixels is, to the segment most of those are fixed to, and starts
+	// in the segment of most of its pixels
+	std::vector<unsigned int> fixedFore(R, 0), fixedBack(R, 0), foreground(R, 0);
 	for (unsigned int y = 0; y < m_h; ++y)
 	{
+		const unsigned int* regions = m_regions->row(y);
+		const unsigned char* trimap = m_trimap->row(y);
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+
 		for (unsigned int x = 0; x < m_w; ++x)
 		{
-			if (x > 0 && y < m_h-1)					// upleft
+			if (trimap[x] == TrimapForeground)
+				fixedFore[regions[x]]++;
+			else if (trimap[x] == TrimapBackground)
+				fixedBack[regions[x]]++;
+			foreground[regions[x]] += BitImage::bit(segmentation, x);
+		}
+	}
+
+	std::vector<unsigned char> trimap(R);
+	SegmentationImage segmentation( R, 1 );
+	Image<unsigned char> components( R, 1 );
+	BitWord* bits = segmentation.row(0);
+
+	for (unsigned int r = 0; r < R; ++r)
+	{
+		if (fixedFore[r] > fixedBack[r])
+			trimap[r] = TrimapForeground;
+		else if (fixedBack[r])
+			trimap[r] = TrimapBackground;
+		else
+			trimap[r] = TrimapUnknown;
+
+		if (trimap[r] == TrimapUnknown)
+			BitImage::setBit(bits, r, 2*foreground[r] >= m_regionFitters[r].samples());
+		else
+			BitImage::setBit(bits, r, trimap[r] == TrimapForeground);
+	}
+
+	// GrabCut over the regions: the GMMs are fit to the sums of the regions, the t-links of a region are
+	// the summed costs of its pixels and the n-links the summed pixel n-links between regions
+	buildGMMs(*m_backgroundGMM, *m_foregroundGMM, components, m_regionFitters, segmentation);
+
+	std::vector<T> backCosts(R), foreCosts(R);
+	std::vector<Graph::node_id> nodes(R);
+	unsigned int iterations = 0;
+	double duration = 0, last = 0;
+	T flow = 0;
+	RefineStop stop = RefineConverged;
+
+	// As refine(), the max flow being the energy of the region segmentation
+	while (!stopsBefore(criteria, iterations, wallClock() - start, duration, stop))
+	{
+		double begin = wallClock();
+		learnGMMs(*m_backgroundGMM, *m_foregroundGMM, components, m_regionFitters, segmentation);
+		evaluateGMMs(*m_backgroundGMM, *m_foregroundGMM, &m_regionFitters[0], R, 0, 0, &backCosts[0], &foreCosts[0]);
+
+		Graph graph;
+		for (unsigned int r = 0; r < R; ++r)
+		{
+			nodes[r] = trimap[r] == TrimapUnknown ? graph.add_node() : 0;
+			if (nodes[r])
+				graph.set_tweights(nodes[r], backCosts[r], foreCosts[r]);
+		}
+
+		// As in initGraph, links to fixed regions go to the t-links of the other
+		for (unsigned int e = 0; e < m_regionLinks.size(); ++e)
+		{
+			unsigned int a = m_regionEdges[2*e], b = m_regionEdges[2*e+1];
+			Real w = m_regionLinks[e];
+
+			if (nodes[a] && nodes[b])
+				graph.add_edge(nodes[a], nodes[b], w, w);
+			else if (nodes[a] || nodes[b])
 			{
-				result += distance2( (*m_image)(x,y), (*m_image)(x-1,y+1) );
-				edges++;
+				Graph::node_id node = nodes[a] ? nodes[a] : nodes[b];
+				if (BitImage::bit(bits, nodes[a] ? b : a))
+					graph.add_tweights(node, w, 0);
+				else
+					graph.add_tweights(node, 0, w);
 			}
+		}
+
+		flow = graph.maxflow();
+
+		int changed = 0;
+		for (unsigned int r = 0; r < R; ++r)
+		{
+			if (!nodes[r])
+				continue;
 
-			if (y < m_h-1)							// up
+			bool fore = graph.what_segment(nodes[r]) == Graph::SOURCE;
+			if (fore != BitImage::bit(bits, r))
 			{
-				result += distance2( (*m_image)(x,y), (*m_image)(x,y+1) );
-				edges++;
+				BitImage::setBit(bits, r, fore);
+				changed++;
 			}
+		}
+		iterations++;
+		duration = wallClock() - begin;
+
+		if (stopsAfter(criteria, iterations, changed, R, last, flow, stop))
+			break;
+		last = flow;
+	}
 
-			if (x < m_w-1 && y < m_h-1)				// upright
+	// Back to pixels, the fixed ones keep their segment
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned int* regions = m_regions->row(y);
+		const unsigned char* pixelTrimap = m_trimap->row(y);
+		BitWord* pixelSegmentation = m_hardSegmentation->row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			if (pixelTrimap[x] == TrimapUnknown)
+				BitImage::setBit(pixelSegmentation, x, BitImage::bit(bits, regions[x]));
+			else
+				BitImage::setBit(pixelSegmentation, x, pixelTrimap[x] == TrimapForeground);
+		}
+	}
+
+	// The band gets what is left of the time, and iterations of its own
+	RefineCriteria remaining = criteria;
+	if (criteria.seconds > 0)
+		remaining.seconds = criteria.seconds - (wallClock() - start);
+
+	if (band && stop != RefineDeadline && (criteria.seconds <= 0 || remaining.seconds > 0))
+	{
+		stop = refineBand(band, remaining, result);
+		if (result)
+			result->iterations += iterations;
+	}
+	else
+	{
+		// The energy is that of the regions under the last GMMs, its data and smoothness summed as
+		// the cut counted them
+		if (result)
+		{
+			*result = RefineResult();
+			result->stop = stop;
+			result->iterations = iterations;
+			result->energy.flow = flow;
+
+			double data = 0, smoothness = 0;
+			for (unsigned int r = 0; r < R; ++r)
 			{
-				result += distance2( (*m_image)(x,y), (*m_image)(x+1,y+1) );
-				edges++;
+				if (trimap[r] == TrimapUnknown)
+					data += BitImage::bit(bits, r) ? foreCosts[r] : backCosts[r];
 			}
-
-			if (x < m_w-1)							// right
+			for (unsigned int e = 0; e < m_regionLinks.size(); ++e)
 			{
-				result += distance2( (*m_image)(x,y), (*m_image)(x+1,y) );
-				edges++;
+				unsigned int a = m_regionEdges[2*e], b = m_regionEdges[2*e+1];
+				if ((trimap[a] == TrimapUnknown || trimap[b] == TrimapUnknown) && BitImage::bit(bits, a) != BitImage::bit(bits, b))
+					smoothness += m_regionLinks[e];
 			}
+			result->energy.data = data;
+			result->energy.smoothness = smoothness;
+			result->energy.energy = data + smoothness;
 		}
+
+		m_GMMStatistics->reset();
+		m_componentsValid = false;
+		m_colorTableValid = false;
+		if (m_driftBound)
+			m_driftBound->reset();
+		if (m_stable)
+			m_stable->fill(0);
+
+		buildImages();
 	}
 
-	m_beta = (Real)(1.0/(2*result/edges));
+	return stop;
 }
 
-void GrabCut::computeL()
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::computeRegions(unsigned int size)
 {
-	m_L = 8*m_lambda + 1;
+	if (!m_regions)
+		m_regions = new Image<unsigned int>( m_w, m_h );
+
+	m_superpixelSize = size;
+	m_regionCount = computeSuperpixels<T>(*m_channels, size, *m_regions);
+
+	const unsigned int R = m_regionCount;
+
+	// Color sums
+	m_regionFitters.assign(R, GaussianFitterN<N, T>());
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned int* regions = m_regions->row(y);
+		const ColorN<N, S>* colors = m_image->row(y);
+		for (unsigned int x = 0; x < m_w; ++x)
+			m_regionFitters[regions[x]].add(toColor<T>(colors[x]));
+	}
+
+	// Region adjacency: the n-links between pixels of different regions, summed per pair of regions.
+	// Each region lists the neighbors numbered above it, few enough to search linearly.
+	std::vector<std::vector<std::pair<unsigned int, Real> > > neighbors(R);
+	std::vector<Real> buffer(m_w);
+	std::vector<T> d2(m_w);
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned int* regions = m_regions->row(y);
+
+		for (unsigned int d = 0; d < C::Directions; ++d)
+		{
+			if (y+C::dy(d) >= m_h)
+				continue;
+
+			unsigned int x0, x1;
+			nlinkRange(d, x0, x1);
+
+			const Real* links = nlinkRow(d, y, &d2[0], &buffer[0]);
+			const unsigned int* neighborRegions = m_regions->row(y+C::dy(d)) + C::dx(d);
+
+			for (unsigned int x = x0; x < x1; ++x)
+			{
+				unsigned int a = regions[x], b = neighborRegions[x];
+				if (a == b)
+					continue;
+				if (a > b)
+					std::swap(a, b);
+
+				std::vector<std::pair<unsigned int, Real> >& list = neighbors[a];
+				unsigned int i = 0;
+				while (i < list.size() && list[i].first != b)
+					i++;
+				if (i == list.size())
+					list.push_back(std::make_pair(b, (Real)0));
+				list[i].second += links[x];
+			}
+		}
+	}
+
+	m_regionEdges.clear();
+	m_regionLinks.clear();
+	for (unsigned int a = 0; a < R; ++a)
+	{
+		for (unsigned int i = 0; i < neighbors[a].size(); ++i)
+		{
+			m_regionEdges.push_back(a);
+			m_regionEdges.push_back(neighbors[a][i].first);
+			m_regionLinks.push_back(neighbors[a][i].second);
+		}
+	}
 }
 
-void GrabCut::buildImages()
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::boundaryBand(unsigned int band, Image<unsigned char>& near) const
 {
-	m_NLinksImage->fill(0);
+	// Mark the pixels on either side of a boundary, then widen the marks by band, rows then columns
+	Image<unsigned char> boundary( m_w, m_h ), widened( m_w, m_h );
+	boundary.fill(0);
+	widened.fill(0);
 
 	for (unsigned int y = 0; y < m_h; ++y)
 	{
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		const BitWord* below = y+1 < m_h ? m_hardSegmentation->row(y+1) : 0;
+		unsigned char* marks = boundary.row(y);
+		unsigned char* marksBelow = below ? boundary.row(y+1) : 0;
+
 		for (unsigned int x = 0; x < m_w; ++x)
 		{
-			// T-Links image is populated in initGraph since we have easy access to the link values there.
+			bool s = BitImage::bit(segmentation, x);
+			if (x+1 < m_w && BitImage::bit(segmentation, x+1) != s)
+				marks[x] = marks[x+1] = 1;
+			if (below && BitImage::bit(below, x) != s)
+				marks[x] = marksBelow[x] = 1;
+		}
+	}
 
-			// N-Links image
-			if( x > 0 && y < m_h-1 )
-				{
-				(*m_NLinksImage)(x,y) += (*m_NLinks)(x,y).upleft/m_L;
-				(*m_NLinksImage)(x-1,y+1) += (*m_NLinks)(x,y).upleft/m_L;
-				}
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned char* marks = boundary.row(y);
+		unsigned char* out = widened.row(y);
 
-			if( y < m_h-1 )
-				{
-				(*m_NLinksImage)(x,y) += (*m_NLinks)(x,y).up/m_L;
-				(*m_NLinksImage)(x,y+1) += (*m_NLinks)(x,y).up/m_L;
-				}
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			if (!marks[x])
+				continue;
+			unsigned int x0 = x > band ? x-band : 0;
+			unsigned int x1 = x+band < m_w ? x+band+1 : m_w;
+			for (unsigned int i = x0; i < x1; ++i)
+				out[i] = 1;
+		}
+	}
 
-			if( x < m_w-1 && y < m_h-1 )
-				{
-				(*m_NLinksImage)(x,y) += (*m_NLinks)(x,y).upright/m_L;
-				(*m_NLinksImage)(x+1,y+1) += (*m_NLinks)(x,y).upright/m_L;
-				}
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		unsigned int y0 = y > band ? y-band : 0;
+		unsigned int y1 = y+band < m_h ? y+band+1 : m_h;
+		unsigned char* out = near.row(y);
 
-			if( x < m_w-1 )
-				{
-				(*m_NLinksImage)(x,y) += (*m_NLinks)(x,y).right/m_L;
-				(*m_NLinksImage)(x+1,y) += (*m_NLinks)(x,y).right/m_L;
-				}
+		for (unsigned int x = 0; x < m_w; ++x)
+			out[x] = 0;
+		for (unsigned int i = y0; i < y1; ++i)
+		{
+			const unsigned char* marks = widened.row(i);
+			for (unsigned int x = 0; x < m_w; ++x)
+				out[x] |= marks[x];
+		}
+	}
+}
 
-			// GMM image
-			if ((*m_hardSegmentation)(x,y) == SegmentationForeground)
-				(*m_GMMImage)(x,y) = Color((Real)((*m_GMMcomponent)(x,y)+1)/m_foregroundGMM->K(),0,0);
-			else
-				(*m_GMMImage)(x,y) = Color(0,(Real)((*m_GMMcomponent)(x,y)+1)/m_backgroundGMM->K(),0);
-			
-			//Alpha image
-			if ((*m_hardSegmentation)(x,y) == SegmentationForeground)
-				(*m_AlphaImage)(x,y) = 0.0;
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::bandTrimap(unsigned int band, Image<unsigned char>& trimap) const
+{
+	Image<unsigned char> near( m_w, m_h );
+	boundaryBand(band, near);
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned char* trimapIn = m_trimap->row(y);
+		const unsigned char* marks = near.row(y);
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		unsigned char* out = trimap.row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			if (trimapIn[x] != TrimapUnknown || marks[x])
+				out[x] = trimapIn[x];
 			else
-				(*m_AlphaImage)(x,y) = 0.75;
+				out[x] = BitImage::bit(segmentation, x) ? TrimapForeground : TrimapBackground;
 		}
 	}
 }
-}
\ No newline at end of file
+
+template <unsigned int N, typename T, typename S, typename C>
+unsigned int GrabCutN<N, T, S, C>::freezeStable()
+{
+	Image<unsigned char> near( m_w, m_h );
+	boundaryBand(m_freezeDistance, near);
+
+	unsigned int frozen = 0;
+	bool thawed = false;
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned char* trimap = m_trimap->row(y);
+		const unsigned char* stable = m_stable->row(y);
+		const unsigned char* marks = near.row(y);
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		unsigned char* active = m_activeTrimap->row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			unsigned char t = trimap[x];
+
+			if (t == TrimapUnknown && stable[x] >= m_freezeIterations && !marks[x])
+			{
+				t = BitImage::bit(segmentation, x) ? TrimapForeground : TrimapBackground;
+				frozen++;
+			}
+			else if (active[x] != t)
+				thawed = true;
+
+			active[x] = t;
+		}
+	}
+
+	// Frozen pixels only got the component of their segment and no t-links meanwhile, as trimap pixels
+	if (thawed)
+	{
+		m_componentsValid = false;
+		if (m_driftBound)
+			m_driftBound->reset();
+	}
+
+	return frozen;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+int GrabCutN<N, T, S, C>::updateHardSegmentation()
+{
+	int changed = 0;
+
+	// Each row is packed a word at a time, the pixels that flipped are the set bits of old ^ new
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned char* trimap = m_trimap->row(y);
+		const Graph::node_id* nodes = m_nodes->row(y);
+		BitWord* segmentation = m_hardSegmentation->row(y);
+		unsigned char* stable = m_stable ? m_stable->row(y) : 0;
+
+		for (unsigned int i = 0; i < m_hardSegmentation->words(); ++i)
+		{
+			unsigned int xEnd = (i+1)*BitWordBits < m_w ? (i+1)*BitWordBits : m_w;
+			BitWord word = 0;
+
+			for (unsigned int x = i*BitWordBits; x < xEnd; ++x)
+			{
+				bool foreground;
+
+				if (trimap[x] == TrimapBackground)
+					foreground = false;
+				else if (trimap[x] == TrimapForeground)
+					foreground = true;
+				else	// TrimapUnknown
+					foreground = m_graph->what_segment(nodes[x]) == Graph::SOURCE;
+
+				word |= (BitWord)foreground << (x%BitWordBits);
+			}
+
+			BitWord flipped = segmentation[i] ^ word;
+			changed += popcount(flipped);
+			segmentation[i] = word;
+
+			// Iterations each pixel has kept its segment for, see setBandFreezing
+			if (stable)
+			{
+				for (unsigned int x = i*BitWordBits; x < xEnd; ++x)
+				{
+					if ((flipped >> (x%BitWordBits)) & 1)
+						stable[x] = 0;
+					else if (stable[x] < 255)
+						stable[x]++;
+				}
+			}
+		}
+	}
+	return changed;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setTrimap(int x1, int y1, int x2, int y2, const TrimapValue& t)
+{
+	(*m_trimap).fillRectangle(x1, y1, x2, y2, t);
+
+	// Immediately set the segmentation as well so that the display will update.
+	if (t == TrimapForeground)
+		(*m_hardSegmentation).fillRectangle(x1, y1, x2, y2, true);
+	else if (t == TrimapBackground)
+		(*m_hardSegmentation).fillRectangle(x1, y1, x2, y2, false);
+
+	// Pixels that were fixed to the other segment have no cached component for their new one,
+	// pixels that became unknown no cached t-links
+	m_componentsValid = false;
+	if (m_driftBound)
+		m_driftBound->reset();
+	if (m_stable)
+		m_stable->fill(0);
+
+	// Build debugging images
+	//buildImages();
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::selectComponents()
+{
+	// Pick the component of each pixel's current segment
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		const unsigned char* foreComponent = m_foreComponent->row(y);
+		const unsigned char* backComponent = m_backComponent->row(y);
+		unsigned char* component = m_GMMcomponent->row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+			component[x] = BitImage::bit(segmentation, x) ? foreComponent[x] : backComponent[x];
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setFitSampling(SamplingMode mode, unsigned int maxSamplesPerModel)
+{
+	m_sampler = FitSampler(mode, maxSamplesPerModel);
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setComponentRange(unsigned int minK, unsigned int maxK)
+{
+	CovarianceModel backModel = m_backgroundGMM->covarianceModel();
+	CovarianceModel foreModel = m_foregroundGMM->covarianceModel();
+
+	delete m_foregroundGMM;
+	delete m_backgroundGMM;
+	delete m_GMMStatistics;
+
+	m_foregroundGMM = new GMMN<N, T>(maxK, foreModel);
+	m_backgroundGMM = new GMMN<N, T>(maxK, backModel);
+	m_foregroundGMM->setMinK(minK);
+	m_backgroundGMM->setMinK(minK);
+	m_GMMStatistics = new GMMStatisticsN<N, T>( m_w, m_h, m_backgroundGMM->capacity(), m_foregroundGMM->capacity() );
+
+	m_componentsValid = false;
+	m_colorTableValid = false;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setCovarianceModel(CovarianceModel model)
+{
+	m_backgroundGMM->setCovarianceModel(model);
+	m_foregroundGMM->setCovarianceModel(model);
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setColorTableBits(unsigned int bits)
+{
+	if (m_colorTable && m_colorTable->bits() == bits)
+		return;
+
+	if (m_colorTable)
+		delete m_colorTable;
+
+	m_colorTable = bits ? new GMMColorTableN<N, T>(bits) : 0;
+	m_colorTableValid = false;
+
+	// The table path does not maintain the cached t-links
+	if (m_driftBound)
+		m_driftBound->reset();
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setNLinkStorage(NLinkStorage storage)
+{
+	if (storage == m_NLinkStorage)
+		return;
+
+	m_NLinkStorage = storage;
+	computeNLinks();
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setLazyTolerance(T tolerance)
+{
+	m_lazyTolerance = tolerance;
+
+	if (tolerance > 0 && !m_driftBound)
+		m_driftBound = new GMMDriftBoundN<N, T>();
+	else if (tolerance <= 0 && m_driftBound)
+	{
+		delete m_driftBound;
+		m_driftBound = 0;
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::setBandFreezing(unsigned int iterations, unsigned int distance)
+{
+	m_freezeIterations = iterations;
+	m_freezeDistance = distance;
+	m_frozen = 0;
+
+	if (iterations && !m_stable)
+	{
+		m_stable = new Image<unsigned char>( m_w, m_h );
+		m_stable->fill(0);
+		m_activeTrimap = new Image<unsigned char>( m_w, m_h );
+		m_activeTrimap->fill(TrimapUnknown);
+	}
+	else if (!iterations && m_stable)
+	{
+		delete m_stable;
+		delete m_activeTrimap;
+		m_stable = 0;
+		m_activeTrimap = 0;
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+T GrabCutN<N, T, S, C>::colorTableErrorBound() const
+{
+	T result = 0;
+
+	if (m_colorTable && m_colorTableValid)
+	{
+		for (unsigned int y = 0; y < m_h; ++y)
+		{
+			const unsigned char* trimap = m_trimap->row(y);
+			const ColorN<N, S>* image = m_image->row(y);
+
+			for (unsigned int x = 0; x < m_w; ++x)
+			{
+				if (trimap[x] == TrimapUnknown)
+				{
+					T bound = m_colorTable->errorBound(m_colorTable->index(toColor<T>(image[x])));
+					if (bound > result)
+						result = bound;
+				}
+			}
+		}
+	}
+
+	return result;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+T GrabCutN<N, T, S, C>::measureColorTableError() const
+{
+	T result = 0;
+
+	if (m_colorTable && m_colorTableValid)
+	{
+		std::vector<ColorN<N, T> > colors(m_w);
+		std::vector<T> foreCosts(m_w), backCosts(m_w);
+
+		for (unsigned int y = 0; y < m_h; ++y)
+		{
+			const unsigned char* trimap = m_trimap->row(y);
+			const ColorN<N, S>* image = m_image->row(y);
+
+			unsigned int n = 0;
+			for (unsigned int x = 0; x < m_w; ++x)
+			{
+				if (trimap[x] == TrimapUnknown)
+					colors[n++] = toColor<T>(image[x]);
+			}
+
+			if (n)
+				evaluateGMMs(*m_backgroundGMM, *m_foregroundGMM, &colors[0], n, 0, 0, &backCosts[0], &foreCosts[0]);
+
+			for (unsigned int j = 0; j < n; ++j)
+			{
+				unsigned int i = m_colorTable->index(colors[j]);
+				T back = fabs(m_colorTable->backCost(i) - backCosts[j]);
+				T fore = fabs(m_colorTable->foreCost(i) - foreCosts[j]);
+
+				if (back > result)
+					result = back;
+				if (fore > result)
+					result = fore;
+			}
+		}
+	}
+
+	return result;
+}
+
+//private functions
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::initGraph()
+{
+	// Set up the graph (it can only be used once, so we have to recreate it each time the graph is updated)
+	if (m_graph)
+		delete m_graph;
+	m_graph = new Graph();
+
+	// Fixed pixels get no node. Their t-link L outweighs all their n-links, so they never change segment
+	// and an n-link from an unknown pixel to one is cut exactly when the unknown pixel takes the other
+	// segment; it is added to that pixel's t-links instead.
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned char* trimap = m_trimap->row(y);
+		Graph::node_id* nodes = m_nodes->row(y);
+		for(unsigned int x = 0; x < m_w; ++x)
+		{
+			nodes[x] = trimap[x] == TrimapUnknown ? m_graph->add_node() : 0;
+		}
+	}
+	
+	// Set T-Link weights
+	// Pixels of a row are gathered by trimap value and run through the fused GMM evaluation, which
+	// yields the -log p t-links of unknown pixels together with the component assignment for the
+	// next learnGMMs. Trimap pixels only need the component of the model of their fixed segment.
+	// The gathered colors are planar, one run of m_w per channel, and read in place by evaluateGMMs.
+	std::vector<T> channels(N*m_w);
+	std::vector<unsigned int> unknownX(m_w), foreX(m_w), backX(m_w);
+	std::vector<unsigned int> foreComponents(m_w), backComponents(m_w);
+	std::vector<T> foreCosts(m_w), backCosts(m_w);
+
+	// With the color table on, the same values are looked up per pixel instead
+	if (m_colorTable && !m_colorTableValid)
+	{
+		m_colorTable->build(*m_backgroundGMM, *m_foregroundGMM);
+		m_colorTableValid = true;
+	}
+
+	for (unsigned int y = 0; y < m_h && m_colorTable; ++y)
+	{
+		const ColorN<N, S>* image = m_image->row(y);
+		const unsigned char* trimap = m_trimap->row(y);
+		const Graph::node_id* nodes = m_nodes->row(y);
+		unsigned char* foreComponent = m_foreComponent->row(y);
+		unsigned char* backComponent = m_backComponent->row(y);
+		T* foreCost = m_foreCost->row(y);
+		T* backCost = m_backCost->row(y);
+		Color* tlinks = m_TLinksImage->row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			unsigned int i = m_colorTable->index(toColor<T>(image[x]));
+			T back, fore;
+
+			if (trimap[x] == TrimapUnknown)
+			{
+				fore = backCost[x] = m_colorTable->backCost(i);
+				back = foreCost[x] = m_colorTable->foreCost(i);
+			}
+			else if (trimap[x] == TrimapBackground)
+			{
+				fore = 0;
+				back = m_L;
+			}
+			else		// TrimapForeground
+			{
+				fore = m_L;
+				back = 0;
+			}
+
+			foreComponent[x] = m_colorTable->foreComponent(i);
+			backComponent[x] = m_colorTable->backComponent(i);
+
+			if (nodes[x])
+				m_graph->set_tweights(nodes[x], fore, back);
+
+			tlinks[x].r = pow((T)fore/m_L, (T)0.25);
+			tlinks[x].g = pow((T)back/m_L, (T)0.25);
+		}
+	}
+
+	// With lazy evaluation, only the pixels of cells whose drift bound went stale are evaluated again,
+	// the others keep their cached costs and components
+	const bool lazy = m_driftBound && !m_colorTable;
+	if (lazy)
+		m_driftBound->update(*m_backgroundGMM, *m_foregroundGMM, m_lazyTolerance);
+
+	for (unsigned int y = 0; y < m_h && !m_colorTable; ++y)
+	{
+		const ColorN<N, S>* image = m_image->row(y);
+		const unsigned char* trimap = m_trimap->row(y);
+		const Graph::node_id* nodes = m_nodes->row(y);
+		unsigned char* foreComponent = m_foreComponent->row(y);
+		unsigned char* backComponent = m_backComponent->row(y);
+		T* foreCost = m_foreCost->row(y);
+		T* backCost = m_backCost->row(y);
+		Color* tlinks = m_TLinksImage->row(y);
+
+		unsigned int n = 0, nFore = 0, nBack = 0;
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			unsigned int cell = lazy ? m_driftBound->index(toColor<T>(image[x])) : 0;
+
+			if (trimap[x] == TrimapUnknown)
+			{
+				if (!lazy || m_driftBound->backStale(cell) || m_driftBound->foreStale(cell))
+					unknownX[n++] = x;
+			}
+			else if (trimap[x] == TrimapForeground)
+			{
+				if (!lazy || m_driftBound->foreStale(cell))
+					foreX[nFore++] = x;
+			}
+			else
+			{
+				if (!lazy || m_driftBound->backStale(cell))
+					backX[nBack++] = x;
+			}
+		}
+
+		unsigned int j;
+
+		if (n)
+		{
+			gatherChannels(*m_channels, y, &unknownX[0], n, &channels[0], m_w);
+			evaluateGMMs(*m_backgroundGMM, *m_foregroundGMM, &channels[0], m_w, n, &backComponents[0], &foreComponents[0], &backCosts[0], &foreCosts[0]);
+			for (j = 0; j < n; ++j)
+			{
+				backCost[unknownX[j]] = backCosts[j];
+				foreCost[unknownX[j]] = foreCosts[j];
+				backComponent[unknownX[j]] = (unsigned char)backComponents[j];
+				foreComponent[unknownX[j]] = (unsigned char)foreComponents[j];
+			}
+		}
+
+		for(unsigned int x = 0; x < m_w; ++x)
+		{
+			T back, fore;
+
+			// The background model's cost is the source capacity ("fore") and vice versa
+			if (trimap[x] == TrimapUnknown )
+			{
+				fore = backCost[x];
+				back = foreCost[x];
+			}
+			else if (trimap[x] == TrimapBackground )
+			{
+				fore = 0;
+				back = m_L;
+			}
+			else		// TrimapForeground
+			{
+				fore = m_L;
+				back = 0;
+			}
+
+			if (nodes[x])
+				m_graph->set_tweights(nodes[x], fore, back);
+
+			tlinks[x].r = pow((T)fore/m_L, (T)0.25);
+			tlinks[x].g = pow((T)back/m_L, (T)0.25);
+		}
+
+		if (nFore)
+		{
+			gatherChannels(*m_channels, y, &foreX[0], nFore, &channels[0], m_w);
+			evaluateGMMs(*m_backgroundGMM, *m_foregroundGMM, &channels[0], m_w, nFore, 0, &foreComponents[0], (T*)0, (T*)0);
+			for (j = 0; j < nFore; ++j)
+				foreComponent[foreX[j]] = (unsigned char)foreComponents[j];
+		}
+
+		if (nBack)
+		{
+			gatherChannels(*m_channels, y, &backX[0], nBack, &channels[0], m_w);
+			evaluateGMMs(*m_backgroundGMM, *m_foregroundGMM, &channels[0], m_w, nBack, &backComponents[0], 0, (T*)0, (T*)0);
+			for (j = 0; j < nBack; ++j)
+				backComponent[backX[j]] = (unsigned char)backComponents[j];
+		}
+	}
+
+	m_componentsValid = true;
+
+	// Set N-Link weights from precomputed values. The edges of a pixel are added in direction order,
+	// each where its neighbor lies inside the image. A link to a fixed pixel goes to the source
+	// capacity of the other when the fixed one is foreground, to its sink capacity when background.
+	int offsets[C::Directions];
+	unsigned int x0[C::Directions], x1[C::Directions];
+	for (unsigned int d = 0; d < C::Directions; ++d)
+	{
+		offsets[d] = m_nodes->offset(C::dx(d), C::dy(d));
+		nlinkRange(d, x0[d], x1[d]);
+	}
+
+	std::vector<Real> buffers(C::Directions*m_w);
+	std::vector<T> d2(m_w);
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const Graph::node_id* nodes = m_nodes->row(y);
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		const Real* links[C::Directions];
+		const BitWord* neighborSegmentation[C::Directions];
+		unsigned int end[C::Directions];	// x1, or 0 where the neighbors' row is past the last one
+		for (unsigned int d = 0; d < C::Directions; ++d)
+		{
+			links[d] = nlinkRow(d, y, &d2[0], &buffers[d*m_w]);
+			end[d] = y+C::dy(d) < m_h ? x1[d] : 0;
+			neighborSegmentation[d] = end[d] ? m_hardSegmentation->row(y+C::dy(d)) : 0;
+		}
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			const Graph::node_id* node = nodes + x;
+
+			for (unsigned int d = 0; d < C::Directions; ++d)
+			{
+				if( x < x0[d] || x >= end[d] )
+					continue;
+
+				Graph::node_id neighbor = node[offsets[d]];
+				Real w = links[d][x];
+
+				if (*node && neighbor)
+					m_graph->add_edge(*node, neighbor, w, w);
+				else if (*node)
+				{
+					if (BitImage::bit(neighborSegmentation[d], x+C::dx(d)))
+						m_graph->add_tweights(*node, w, 0);
+					else
+						m_graph->add_tweights(*node, 0, w);
+				}
+				else if (neighbor)
+				{
+					if (BitImage::bit(segmentation, x))
+						m_graph->add_tweights(neighbor, w, 0);
+					else
+						m_graph->add_tweights(neighbor, 0, w);
+				}
+			}
+		}
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::neighborDistances(unsigned int y, int offset, unsigned int x0, unsigned int x1, T* d2) const
+{
+	for (unsigned int x = x0; x < x1; ++x)
+		d2[x] = 0;
+
+	for (unsigned int k = 0; k < N; k++)
+	{
+		const S* c = m_channels->row(k, y);
+		for (unsigned int x = x0; x < x1; ++x)
+		{
+			T d = level<T>(c[x]) - level<T>(c[x+offset]);
+			d2[x] += d*d;
+		}
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::nlinkRange(unsigned int d, unsigned int& x0, unsigned int& x1) const
+{
+	int dx = C::dx(d);
+	unsigned int reach = dx < 0 ? -dx : dx;
+
+	if (reach >= m_w)
+	{
+		x0 = x1 = 0;
+		return;
+	}
+
+	x0 = dx < 0 ? reach : 0;
+	x1 = dx > 0 ? m_w-reach : m_w;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::computeNLinkRow(unsigned int d, unsigned int y, T* d2, Real* links) const
+{
+	// Each direction is a straight run over the pixels it exists for, the others stay zero so that
+	// loops over every pixel need no edge checks. Weights are divided by the length of the link.
+	unsigned int x0, x1;
+	nlinkRange(d, x0, x1);
+
+	for (unsigned int x = 0; x < m_w; ++x)
+		links[x] = 0;
+
+	if (y+C::dy(d) >= m_h)
+		return;
+
+	neighborDistances( y, m_channels->offset(C::dx(d), C::dy(d)), x0, x1, d2 );
+
+	if (C::dx(d) && C::dy(d))
+	{
+		const T length = sqrt((T)(C::dx(d)*C::dx(d) + C::dy(d)*C::dy(d)));
+		for( unsigned int x = x0; x < x1; ++x )
+			links[x] = m_lambda * exp( -m_beta * d2[x] ) / length;
+	}
+	else
+	{
+		for( unsigned int x = x0; x < x1; ++x )
+			links[x] = m_lambda * exp( -m_beta * d2[x] );
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::computeNLinks()
+{
+	if (m_NLinks)
+		delete m_NLinks;
+	if (m_NLinks16)
+		delete m_NLinks16;
+	if (m_NLinks8)
+		delete m_NLinks8;
+	m_NLinks = 0;
+	m_NLinks16 = 0;
+	m_NLinks8 = 0;
+
+	if (m_NLinkStorage == NLinksOnTheFly)
+		return;
+
+	// No weight exceeds lambda, the levels divide [0,lambda]
+	if (m_NLinkStorage == NLinksReal)
+		m_NLinks = new PlanarImage<Real>( m_w, m_h, C::Directions );
+	else if (m_NLinkStorage == NLinks16Bit)
+	{
+		m_NLinks16 = new PlanarImage<unsigned short>( m_w, m_h, C::Directions );
+		m_NLinkScale = m_lambda / 65535;
+	}
+	else
+	{
+		m_NLinks8 = new PlanarImage<unsigned char>( m_w, m_h, C::Directions );
+		m_NLinkScale = m_lambda / 255;
+	}
+
+	std::vector<T> d2(m_w);
+	std::vector<Real> buffer(m_w);
+
+	for( unsigned int y = 0; y < m_h; ++y )
+	{
+		for( unsigned int d = 0; d < C::Directions; ++d )
+		{
+			if (m_NLinks)
+			{
+				computeNLinkRow( d, y, &d2[0], m_NLinks->row(d, y) );
+				continue;
+			}
+
+			computeNLinkRow( d, y, &d2[0], &buffer[0] );
+
+			if (m_NLinks16)
+			{
+				unsigned short* levels = m_NLinks16->row(d, y);
+				for( unsigned int x = 0; x < m_w; ++x )
+					levels[x] = (unsigned short)(buffer[x]/m_NLinkScale + (Real)0.5);
+			}
+			else
+			{
+				unsigned char* levels = m_NLinks8->row(d, y);
+				for( unsigned int x = 0; x < m_w; ++x )
+					levels[x] = (unsigned char)(buffer[x]/m_NLinkScale + (Real)0.5);
+			}
+		}
+	}
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+const Real* GrabCutN<N, T, S, C>::nlinkRow(unsigned int d, unsigned int y, T* d2, Real* buffer) const
+{
+	if (m_NLinks)
+		return m_NLinks->row(d, y);
+
+	if (m_NLinks16)
+	{
+		const unsigned short* levels = m_NLinks16->row(d, y);
+		for (unsigned int x = 0; x < m_w; ++x)
+			buffer[x] = levels[x]*m_NLinkScale;
+	}
+	else if (m_NLinks8)
+	{
+		const unsigned char* levels = m_NLinks8->row(d, y);
+		for (unsigned int x = 0; x < m_w; ++x)
+			buffer[x] = levels[x]*m_NLinkScale;
+	}
+	else
+		computeNLinkRow(d, y, d2, buffer);
+
+	return buffer;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::computeBeta()
+{
+	// Summed in double per direction, over the pixels each direction exists for
+	double result = 0, edges = 0;
+
+	std::vector<T> d2(m_w);
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		for (unsigned int d = 0; d < C::Directions; ++d)
+		{
+			if (y+C::dy(d) >= m_h)
+				continue;
+
+			unsigned int x0, x1;
+			nlinkRange(d, x0, x1);
+
+			neighborDistances(y, m_channels->offset(C::dx(d), C::dy(d)), x0, x1, &d2[0]);
+			for (unsigned int x = x0; x < x1; ++x)
+				result += d2[x];
+
+			edges += x1 > x0 ? x1 - x0 : 0;
+		}
+	}
+
+	m_beta = (T)(1.0/(2*result/edges));
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::computeL()
+{
+	// More than the sum of the n-links of any pixel, 8*lambda+1 for the 8-neighborhood
+	m_L = 2*C::Directions*m_lambda + 1;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::computeEnergy(GibbsEnergy& energy) const
+{
+	// Summed in double, like beta
+	double data = 0, smoothness = 0;
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const unsigned char* trimap = m_trimap->row(y);
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		const T* foreCost = m_foreCost->row(y);
+		const T* backCost = m_backCost->row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			if (trimap[x] == TrimapUnknown)
+				data += BitImage::bit(segmentation, x) ? foreCost[x] : backCost[x];
+		}
+	}
+
+	std::vector<Real> buffer(m_w);
+	std::vector<T> d2(m_w);
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+
+		for (unsigned int d = 0; d < C::Directions; ++d)
+		{
+			if (y+C::dy(d) >= m_h)
+				continue;
+
+			unsigned int x0, x1;
+			nlinkRange(d, x0, x1);
+
+			const Real* links = nlinkRow(d, y, &d2[0], &buffer[0]);
+			const BitWord* neighbors = m_hardSegmentation->row(y+C::dy(d));
+
+			for (unsigned int x = x0; x < x1; ++x)
+			{
+				if (BitImage::bit(segmentation, x) != BitImage::bit(neighbors, x+C::dx(d)))
+					smoothness += links[x];
+			}
+		}
+	}
+
+	energy.data = data;
+	energy.smoothness = smoothness;
+	energy.energy = data + smoothness;
+}
+
+template <unsigned int N, typename T, typename S, typename C>
+void GrabCutN<N, T, S, C>::buildImages()
+{
+	m_NLinksImage->fill(0);
+
+	// N-Links image, one direction at a time. The n-links leaving the image are zero and land in the
+	// border of the N-Links image.
+	int offsets[C::Directions];
+	for (unsigned int d = 0; d < C::Directions; ++d)
+		offsets[d] = m_NLinksImage->offset(C::dx(d), C::dy(d));
+
+	std::vector<Real> buffer(m_w);
+	std::vector<T> d2(m_w);
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		Real* nlinks = m_NLinksImage->row(y);
+
+		for (unsigned int d = 0; d < C::Directions; ++d)
+		{
+			const Real* links = nlinkRow(d, y, &d2[0], &buffer[0]);
+			Real* neighbors = nlinks + offsets[d];
+
+			for (unsigned int x = 0; x < m_w; ++x)
+			{
+				nlinks[x] += links[x]/m_L;
+				neighbors[x] += links[x]/m_L;
+			}
+		}
+	}
+
+	for (unsigned int y = 0; y < m_h; ++y)
+	{
+		const BitWord* segmentation = m_hardSegmentation->row(y);
+		const unsigned char* component = m_GMMcomponent->row(y);
+		Color* gmm = m_GMMImage->row(y);
+		Real* alpha = m_AlphaImage->row(y);
+
+		for (unsigned int x = 0; x < m_w; ++x)
+		{
+			// T-Links image is populated in initGraph since we have easy access to the link values there.
+
+			// GMM image
+			if (BitImage::bit(segmentation, x))
+				gmm[x] = Color((Real)(component[x]+1)/m_foregroundGMM->K(),0,0);
+			else
+				gmm[x] = Color(0,(Real)(component[x]+1)/m_backgroundGMM->K(),0);
+			
+			//Alpha image
+			if (BitImage::bit(segmentation, x))
+				alpha[x] = 0.0;
+			else
+				alpha[x] = 0.75;
+		}
+	}
+}
+
+// Gray, RGB and RGB plus one extra channel, see ColorN, in single and double precision, 8-connected
+template class GrabCutN<1, float>;
+template class GrabCutN<3, float>;
+template class GrabCutN<4, float>;
+template class GrabCutN<1, double>;
+template class GrabCutN<3, double>;
+template class GrabCutN<4, double>;
+
+// and on 8-bit input
+template class GrabCutN<1, float, unsigned char>;
+template class GrabCutN<3, float, unsigned char>;
+template class GrabCutN<4, float, unsigned char>;
+
+// RGB with the other neighborhoods
+template class GrabCutN<3, float, float, Neighborhood4>;
+template class GrabCutN<3, float, unsigned char, Neighborhood4>;
+template class GrabCutN<3, float, float, Neighborhood16>;
+template class GrabCutN<3, float, unsigned char, Neighborhood16>;
+
+}
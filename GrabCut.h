@@ -17,70 +17,270 @@
 
 namespace GrabCutNS {
 
-class GrabCut
+// Gibbs energy E = U + V of the segmentation after a refinement, summed in double. U is the data term,
+// -log p of every unknown pixel under the GMM of its segment, as of the pixel's last evaluation (pixels
+// frozen by setBandFreezing keep theirs). V is the smoothness term, the n-links between neighbors in
+// different segments. flow is the max flow of the cut, the part of E the graph covered.
+struct GibbsEnergy
+{
+	GibbsEnergy() : data(0), smoothness(0), energy(0), flow(0) {}
+
+	double data, smoothness, energy, flow;
+};
+
+// What refine() stops on besides convergence, no pixel changing; each is off at 0. maxIterations counts
+// refinements, the check of a banded cut (see setBandFreezing) being one. energyDecrease stops once an
+// iteration lowers the energy by less than that fraction. changedFraction stops once an iteration
+// changes at most that fraction of the pixels. seconds is a wall-clock budget: no iteration is started
+// that would overrun it if it took as long as the last one (the first always runs).
+struct RefineCriteria
+{
+	RefineCriteria() : maxIterations(0), energyDecrease(0), changedFraction(0), seconds(0) {}
+
+	unsigned int maxIterations;
+	double energyDecrease;
+	double changedFraction;
+	double seconds;
+};
+
+// The criterion refine() stopped on
+enum RefineStop { RefineConverged, RefineMaxIterations, RefineEnergy, RefineChanged, RefineDeadline };
+
+// How a refine() went: the criterion it stopped on, the refinements it ran and the Gibbs energy of the
+// final segmentation (its flow that of the last cut). mismatched is the number of pixels the check of a
+// converged banded cut moved (see setBandFreezing), -1 when there was no check, and frozen the number of
+// pixels the last refinement kept out of its cut.
+struct RefineResult
+{
+	RefineResult() : stop(RefineConverged), iterations(0), mismatched(-1), frozen(0) {}
+
+	RefineStop stop;
+	unsigned int iterations;
+	GibbsEnergy energy;
+	int mismatched;
+	unsigned int frozen;
+};
+
+// GrabCut over images of N channel colors, see ColorN, computed in precision T. The GMMs, n-links and all
+// per-pixel kernels are compiled for both; instances exist for N = 1, 3 and 4 in float and double, GrabCut
+// being RGB in the default precision. The output and debug images are in the default precision either way.
+// The input channels are stored as S: T, or unsigned char for 8-bit input (see Color8), which the kernels
+// convert as they read it. Instances with 8-bit input exist in float. C is the neighborhood of the graph,
+// Neighborhood8 by default; Neighborhood4 halves the n-links and edges at the cost of blockier boundaries,
+// Neighborhood16 doubles them. Instances with those exist for RGB in float.
+template <unsigned int N, typename T = Real, typename S = T, typename C = Neighborhood8>
+class GrabCutN
 {
 public:
 
-	GrabCut( Image<Color> *image );
+	// The image is only read, and may be a view (see Image) over the caller's pixels or a rectangle
+	// of a larger image. It must outlive the GrabCut.
+	GrabCutN( const Image<ColorN<N, S> > *image );
 
-	~GrabCut();
+	~GrabCutN();
 
 	// Initialize Trimap, inside rectangle is TrimapUnknown, outside is TrimapBackground
 	void initialize(unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2);
+	// Or from a mask, the nonzero pixels being Unknown and the others Background
 	void initializeWithMask(Image<Color>* mask);
+	void initializeWithMask(Image<unsigned char>* mask);
 
 	// Edit Trimap
 	void setTrimap(int x1, int y1, int x2, int y2, const TrimapValue& t);
 	
 	void fitGMMs();
 
-	// Run Grabcut refinement on the hard segmentation
-	void refine();
-	int refineOnce();	// returns the number of pixels that have changed from foreground to background or vice versa
+	// Run Grabcut refinement on the hard segmentation, until it converges or meets one of the criteria.
+	// Returns the criterion, and fills result if given.
+	RefineStop refine(const RefineCriteria& criteria = RefineCriteria(), RefineResult* result = 0);
+	int refineOnce(GibbsEnergy* energy = 0);	// returns the number of pixels that have changed from foreground to background or vice versa,
+												// and with energy, the Gibbs energy of the new segmentation
+
+	// Coarse to fine refinement for large images. The image, trimap and segmentation are halved levels
+	// times and GrabCut runs to convergence on the smallest. Each finer level starts from the segmentation
+	// of the one below and its GMMs, and only refines the pixels within band pixels of that boundary, the
+	// others keeping their label. The trimap is left as set; levels = 0 is refine(). Every level stops as
+	// refine() on criteria, the levels sharing its seconds but counting their iterations apiece; a level
+	// that runs out of time leaves the finer ones at its result. Returns the criterion of the last level
+	// run, and fills result if given with its outcome and the iterations of all levels.
+	RefineStop refinePyramid(unsigned int levels, unsigned int band = 2, const RefineCriteria& criteria = RefineCriteria(), RefineResult* result = 0);
+
+	// Superpixel mode for large images: GrabCut runs on a graph of SLIC regions of about size x size
+	// pixels (see computeSuperpixels), computed once per size, instead of pixels. Each region enters the
+	// GMMs with all of its pixels, through the sums of their colors, as one component's; its t-links are
+	// the summed costs of its pixels, computed from those sums (see evaluateGMMs over groups), and its
+	// n-links the sums of the pixel n-links across its borders. A region with fixed pixels is fixed. The
+	// result is then refined at the pixel level within band pixels of the region boundary; 0 keeps it as
+	// is. Both stages stop as refine() on criteria, the max flow being the energy of the regions and
+	// changedFraction of their count; they share its seconds but count their iterations apiece. Returns
+	// the criterion of the last stage run, and fills result if given with its outcome and the iterations
+	// of both, the energy of the region stage being that of its last cut.
+	RefineStop refineSuperpixels(unsigned int size, unsigned int band = 2, const RefineCriteria& criteria = RefineCriteria(), RefineResult* result = 0);
 
 	const Image<Real>*	getAlphaImage() const	{ return m_AlphaImage; }
 	const Image<Real>*	getNLinksImage() const	{ return m_NLinksImage; }
 	const Image<Color>* getTLinksImage() const	{ return m_TLinksImage; }
 	const Image<Color>* getGMMsImage() const	{ return m_GMMImage; }
-	const Image<Color>* getImage() const		{ return m_image; }
+	const Image<ColorN<N, S> >* getImage() const	{ return m_image; }
 
 	void buildImages();
 
+	// Covariance model of both GMMs (CovarianceFull by default), used from the next fitGMMs or refinement on
+	void setCovarianceModel(CovarianceModel model);
+
+	// Evaluate t-links and component assignments through a table over the color cube quantized to 2^bits
+	// levels per channel, rebuilt after every GMM update, instead of per pixel. 0 (the default) turns the
+	// table off and evaluates the GMMs exactly.
+	void setColorTableBits(unsigned int bits);
+
+	// Error of the color table t-links against exact evaluation over the current unknown pixels:
+	// the guaranteed upper bound from the table, and the actual maximum found by evaluating exactly.
+	// Both are 0 when the table is off.
+	T colorTableErrorBound() const;
+	T measureColorTableError() const;
+
+	// Fit the GMMs to at most about maxSamplesPerModel pixels of each segment, chosen by mode (see
+	// FitSampler). SamplingAll (the default) fits every pixel. Used from the next fitGMMs on.
+	void setFitSampling(SamplingMode mode, unsigned int maxSamplesPerModel);
+
+	// Let each GMM choose its number of components between minK and maxK (at most 127) by BIC: in fitGMMs,
+	// and by merging components during refinement. Both default to 5, which fixes K. Takes effect from
+	// the next fitGMMs on.
+	void setComponentRange(unsigned int minK, unsigned int maxK);
+
+	// Lazy t-link evaluation: between refinements, only re-evaluate the pixels whose -log p may have
+	// changed by more than tolerance since it was last computed (see GMMDriftBound); the others keep
+	// their cached t-links and components. 0 (the default) evaluates every pixel every time. Not used
+	// while the color table is on.
+	void setLazyTolerance(T tolerance);
+
+	// Storage of the n-link weights (NLinksReal by default). The quantized levels take 8 or 4 bytes per
+	// pixel instead of 16 and perturb the weights by at most half a level, lambda/65535 or lambda/255;
+	// NLinksOnTheFly keeps nothing and recomputes the weights from the colors in every initGraph.
+	void setNLinkStorage(NLinkStorage storage);
+
+	// Band freezing: the unknown pixels that have kept their segment for the last iterations refinements
+	// and lie farther than distance from the boundary are fixed to it for the next graph cut, which then
+	// only covers the band along the boundary. Once that converges, refine() checks it with one cut over
+	// every unknown pixel under the same GMMs, keeps that cut and reports the pixels it moved (see
+	// RefineResult), 0 when the banded cut was exact. 0 iterations (the default) turns it off.
+	void setBandFreezing(unsigned int iterations, unsigned int distance = 4);
+
+	// Clustering fitGMMs builds the initial GMMs with (InitOrchardBouman by default)
+	void setInitialization(GMMInitialization initialization)	{ m_initialization = initialization; }
+
 private:
 
 	unsigned int m_w, m_h;				// All the following Image<*> variables will be the same width and height.
 										// Store them here so we don't have to keep asking for them.
-	Image<Color> *m_image;
-	Image<TrimapValue> *m_trimap;
-	Image<unsigned int> *m_GMMcomponent;
-	Image<SegmentationValue> *m_hardSegmentation;
+	const Image<ColorN<N, S> > *m_image;
+	PlanarImage<S> *m_channels;			// the image split into one plane per channel, for the streaming kernels
+	// Labels take a byte per pixel (a TrimapValue, a component below 128) and the hard segmentation a bit
+	Image<unsigned char> *m_trimap;
+	Image<unsigned char> *m_GMMcomponent;
+	SegmentationImage *m_hardSegmentation;
 
 	Image<Real> *m_softSegmentation;	// Not yet implemented (this would be interpreted as alpha)
 
-	GMM *m_backgroundGMM, *m_foregroundGMM;
+	GMMN<N, T> *m_backgroundGMM, *m_foregroundGMM;
+	GMMStatisticsN<N, T> *m_GMMStatistics;		// sums the GMMs are relearnt from, reset by fitGMMs
+	FitSampler m_sampler;				// pixels the GMMs are fit to, see setFitSampling
+	GMMInitialization m_initialization;
+
+	// Most likely foreground and background component of each pixel, computed along with the t-links
+	// in initGraph. While valid, the next learnGMMs takes its component assignment from these instead
+	// of evaluating the GMMs again. Trimap pixels only get the component of their fixed segment.
+	Image<unsigned char> *m_foreComponent, *m_backComponent;
+	bool m_componentsValid;
+
+	void selectComponents();	// copies the cached component of each pixel's segment to m_GMMcomponent
+
+	// -log p of every unknown pixel under each model, kept between initGraph calls, and the bound on
+	// their drift since, see setLazyTolerance
+	Image<T> *m_backCost, *m_foreCost;
+	GMMDriftBoundN<N, T> *m_driftBound;
+	T m_lazyTolerance;
+
+	// Optional color quantized lookup of t-links and components, see setColorTableBits
+	GMMColorTableN<N, T> *m_colorTable;
+	bool m_colorTableValid;
+
+	// Superpixel mode, see refineSuperpixels: the region of every pixel, and per region the sums of its
+	// colors (its pixel count, color sum and sum of color products) and its summed n-links to each
+	// neighboring region, edge e joining regions m_regionEdges[2e] and m_regionEdges[2e+1] with weight
+	// m_regionLinks[e]
+	unsigned int m_superpixelSize;
+	Image<unsigned int> *m_regions;
+	unsigned int m_regionCount;
+	std::vector<GaussianFitterN<N, T> > m_regionFitters;
+	std::vector<unsigned int> m_regionEdges;
+	std::vector<Real> m_regionLinks;
+
+	void computeRegions(unsigned int size);
+
+	// Band freezing, see setBandFreezing: the number of iterations each pixel has kept its segment for
+	// (saturated), and the trimap of the last cut with the frozen pixels fixed
+	unsigned int m_freezeIterations, m_freezeDistance;
+	Image<unsigned char> *m_stable, *m_activeTrimap;
+	unsigned int m_frozen;			// pixels frozen in the last refineOnce
+
+	unsigned int freezeStable();	// fills m_activeTrimap, returns the number of pixels frozen
+	int cutUnbanded(T& flow);		// cuts every unknown pixel with the current GMMs, returns the number changed
 
 	int updateHardSegmentation();		// Update hard segmentation after running GraphCut, 
 										// Returns the number of pixels that have changed from foreground to background or vice versa.
 
 	// Variables used in formulas from the paper.
-	Real m_lambda;		// lambda = 50. This value was suggested the GrabCut paper.
-	Real m_beta;		// beta = 1 / ( 2 * average of the squared color distances between all pairs of neighboring pixels (8-neighborhood) )
-	Real m_L;			// L = a large value to force a pixel to be foreground or background
+	T m_lambda;		// lambda = 50. This value was suggested the GrabCut paper.
+	T m_beta;		// beta = 1 / ( 2 * average of the squared color distances between all pairs of neighboring pixels (8-neighborhood) )
+	T m_L;			// L = a large value to force a pixel to be foreground or background
 
 	void computeBeta();
 	void computeL();
+	void computeEnergy(GibbsEnergy& energy) const;	// all but the flow
 
-	// Precomputed N-link weights
-	Image<NLinks> *m_NLinks;
+	// Precomputed N-link weights, one plane per direction of C, in the form chosen by setNLinkStorage:
+	// Real weights, or levels of m_NLinkScale in 16 or 8 bits. The others are null.
+	NLinkStorage m_NLinkStorage;
+	PlanarImage<Real> *m_NLinks;
+	PlanarImage<unsigned short> *m_NLinks16;
+	PlanarImage<unsigned char> *m_NLinks8;
+	Real m_NLinkScale;
 
 	void computeNLinks();
-	Real computeNLink(unsigned int x1, unsigned int y1, unsigned int x2, unsigned int y2);
+
+	// Weights of row y in direction d, zero for the links that would leave the image. nlinkRow returns
+	// the stored row, or the row decoded or computed into buffer; d2 is scratch for m_w values.
+	void computeNLinkRow(unsigned int d, unsigned int y, T* d2, Real* links) const;
+
+	// Columns x0 to x1-1 whose neighbor in direction d lies within the image width
+	void nlinkRange(unsigned int d, unsigned int& x0, unsigned int& x1) const;
+	const Real* nlinkRow(unsigned int d, unsigned int y, T* d2, Real* buffer) const;
+
+	// Squared color distances of pixels x0 to x1-1 of row y to their neighbors at offset
+	void neighborDistances(unsigned int y, int offset, unsigned int x0, unsigned int x1, T* d2) const;
 
 	// Graph for Graphcut
 	Graph *m_graph;
 	Image<Graph::node_id> *m_nodes;
 
-	void initGraph();	// builds the graph for GraphCut
+	void initGraph();	// builds the graph for GraphCut, with nodes for the unknown pixels only
+
+	// Whether refinePyramid halves this level again, down to a few dozen pixels at most
+	bool halvable(unsigned int levels) const	{ return levels > 0 && m_w >= 64 && m_h >= 64; }
+
+	// Marks the pixels within band (in both directions) of the boundary of the hard segmentation
+	void boundaryBand(unsigned int band, Image<unsigned char>& near) const;
+
+	// Refine the pixels within band of the boundary, the others fixed to their segment (trimap unchanged)
+	RefineStop refineBand(unsigned int band, const RefineCriteria& criteria = RefineCriteria(), RefineResult* result = 0);
+
+	// Trimap of refineBand: the unknown pixels farther than band from the boundary of
+	// the hard segmentation are fixed to their segment
+	void bandTrimap(unsigned int band, Image<unsigned char>& trimap) const;
+
+	// The engine of the coarser level is a GrabCutN on T colors
+	template <unsigned int, typename, typename, typename> friend class GrabCutN;
 
 	// Images of various variables that can be displayed for debugging.
 	Image<Real> *m_NLinksImage;
@@ -89,5 +289,8 @@ private:
 	Image<Real> *m_AlphaImage;
 };
 
+typedef GrabCutN<3> GrabCut;
+typedef GrabCutN<3, Real, unsigned char> GrabCut8;
+
 }
 #endif //GRAB_CUT_H
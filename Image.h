@@ -14,47 +14,217 @@
 // Images, really just a templatized 2D array. We use this for all the image variables.
 namespace GrabCutNS {
 
+// Image rows start on 64 byte boundaries (a cache line, and the widest SIMD load) and the stride is padded
+// to keep every row there. Pixel types whose size does not divide 64 get the alignment their size allows.
+static const unsigned int ImageAlignment = 64;
+
+// Smallest number of pixels of type T that spans a multiple of ImageAlignment bytes
+template<class T>
+inline unsigned int alignmentPixels()
+{
+	unsigned int n = 1;
+	while ((n*sizeof(T)) % ImageAlignment)
+		n++;
+	return n;
+}
+
+// First pixel of an allocation that lies on an ImageAlignment boundary, allocations are made
+// ImageAlignment pixels larger than needed to leave room for it
+template<class T>
+inline T* alignedPixels(T* data)
+{
+	for (unsigned int i = 0; i < ImageAlignment; ++i)
+	{
+		if (reinterpret_cast<size_t>(data + i) % ImageAlignment == 0)
+			return data + i;
+	}
+	return data;
+}
+
 template<class T>
 class Image
 {
 
 public:
-	Image(unsigned int width, unsigned int height);
+	// An optional ghost border of the given number of pixels surrounds the image, so that loops over
+	// neighbors can read and write past the edges without branches. fill covers the border as well.
+	Image(unsigned int width, unsigned int height, unsigned int border = 0);
+
+	// Views, which own no memory: over external pixels, rows stride elements apart (a decoder's output,
+	// a mapped file), or over the width x height rectangle at (x,y) of a parent image, which must lie
+	// inside it. The memory must outlive the view. Views have no border.
+	Image(T* data, unsigned int width, unsigned int height, unsigned int stride);
+	Image(Image<T>& parent, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+
 	~Image();
 
+	bool isView() const { return m_data == 0; }
+
+	// First pixel; rows are stride() elements apart
 	T* ptr() { return m_image; }
 
-	T& operator() (int x, int y) { clampX(x); clampY(y); return m_image[y*m_width+x]; }
-	const T& operator() (int x, int y) const { clampX(x); clampY(y); return m_image[y*m_width+x]; }
+	// Access with x and y clamped to the image
+	T& operator() (int x, int y) { clampX(x); clampY(y); return m_image[y*(int)m_stride+x]; }
+	const T& operator() (int x, int y) const { clampX(x); clampY(y); return m_image[y*(int)m_stride+x]; }
+
+	// Unchecked access for loops that stay inside the image or its border
+	T& at(int x, int y) { return m_image[y*(int)m_stride+x]; }
+	const T& at(int x, int y) const { return m_image[y*(int)m_stride+x]; }
+
+	T* row(int y) { return m_image + y*(int)m_stride; }
+	const T* row(int y) const { return m_image + y*(int)m_stride; }
+
+	// Offset from a pixel to its neighbor (dx,dy), for iterating over neighbors through a pointer
+	int offset(int dx, int dy) const { return dy*(int)m_stride + dx; }
 
 	void fillRectangle(int x1, int y1, int x2, int y2, const T& t);
 	void fill(const T& t);
 
 	unsigned int width() const { return m_width; }
 	unsigned int height() const { return m_height; }
+	unsigned int stride() const { return m_stride; }
+	unsigned int border() const { return m_border; }
+
+private:
+
+	void clampX(int& x) const { if (x < 0) x = 0; if (x >= (int)m_width)  x = m_width-1; }
+	void clampY(int& y) const { if (y < 0) y = 0; if (y >= (int)m_height) y = m_height-1; }
+
+	T* m_data;		// allocation, null for a view
+	T* m_begin;		// its aligned part, m_size pixels with the border and the padding; unused by a view
+	T* m_image;		// pixel (0,0)
+	unsigned int m_width, m_height, m_stride, m_border, m_size;
+};
+
+// Planes of T sharing the layout of an Image<T>, one plane per field of a multi-field pixel (the
+// channels of a color, the directions of the n-links). Kernels stream one contiguous field at a time
+// instead of picking it out of interleaved structs.
+template<class T>
+class PlanarImage
+{
+
+public:
+	PlanarImage(unsigned int width, unsigned int height, unsigned int planes, unsigned int border = 0);
+	~PlanarImage();
+
+	T& at(unsigned int plane, int x, int y) { return m_image[plane*m_planeStride + y*(int)m_stride + x]; }
+	const T& at(unsigned int plane, int x, int y) const { return m_image[plane*m_planeStride + y*(int)m_stride + x]; }
+
+	T* row(unsigned int plane, int y) { return m_image + plane*m_planeStride + y*(int)m_stride; }
+	const T* row(unsigned int plane, int y) const { return m_image + plane*m_planeStride + y*(int)m_stride; }
+
+	int offset(int dx, int dy) const { return dy*(int)m_stride + dx; }
+
+	void fill(const T& t);
+
+	unsigned int width() const { return m_width; }
+	unsigned int height() const { return m_height; }
+	unsigned int planes() const { return m_planes; }
+	unsigned int stride() const { return m_stride; }
+	unsigned int planeStride() const { return m_planeStride; }	// elements from a pixel to the same pixel of the next plane
+
+private:
+
+	T* m_data;
+	T* m_begin;
+	T* m_image;		// pixel (0,0) of plane 0
+	unsigned int m_width, m_height, m_planes, m_stride, m_planeStride;
+};
+
+// Binary image packed 32 pixels to a word, pixel x of a row being bit x%32 of word x/32. The bits past
+// the width in the last word of a row stay clear, so rows compare and count a word at a time.
+typedef unsigned int BitWord;
+static const unsigned int BitWordBits = 32;
+
+// Number of set bits
+inline unsigned int popcount(BitWord w)
+{
+#ifdef __GNUC__
+	return __builtin_popcount(w);
+#else
+	w = w - ((w >> 1) & 0x55555555);
+	w = (w & 0x33333333) + ((w >> 2) & 0x33333333);
+	return (((w + (w >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+#endif
+}
+
+class BitImage
+{
+
+public:
+	BitImage(unsigned int width, unsigned int height);
+
+	bool operator() (unsigned int x, unsigned int y) const { return bit(m_bits.row(y), x); }
+	void set(unsigned int x, unsigned int y, bool value) { setBit(m_bits.row(y), x, value); }
+
+	BitWord* row(int y) { return m_bits.row(y); }
+	const BitWord* row(int y) const { return m_bits.row(y); }
+
+	static bool bit(const BitWord* row, unsigned int x) { return (row[x/BitWordBits] >> (x%BitWordBits)) & 1; }
+	static void setBit(BitWord* row, unsigned int x, bool value)
+	{
+		BitWord mask = (BitWord)1 << (x%BitWordBits);
+		if (value)
+			row[x/BitWordBits] |= mask;
+		else
+			row[x/BitWordBits] &= ~mask;
+	}
+
+	// Bits of the last word of a row that are pixels
+	BitWord lastWordMask() const { return m_width%BitWordBits ? ((BitWord)1 << (m_width%BitWordBits)) - 1 : ~(BitWord)0; }
+
+	void fillRectangle(int x1, int y1, int x2, int y2, bool value);
+	void fill(bool value);
+
+	unsigned int count() const;		// number of set pixels
+
+	unsigned int width() const { return m_width; }
+	unsigned int height() const { return m_height; }
+	unsigned int words() const { return m_bits.width(); }	// words per row
 
 private:
 
 	void clampX(int& x) const { if (x < 0) x = 0; if (x >= (int)m_width)  x = m_width-1; }
 	void clampY(int& y) const { if (y < 0) y = 0; if (y >= (int)m_height) y = m_height-1; }
 
-	T* m_image;
 	unsigned int m_width, m_height;
+	Image<BitWord> m_bits;
 };
 
 
 // Image member functions
 template<class T>
-Image<T>::Image(unsigned int width, unsigned int height) : m_width(width), m_height(height)
+Image<T>::Image(unsigned int width, unsigned int height, unsigned int border) : m_width(width), m_height(height), m_border(border)
+{
+	// The left border is rounded up as well, so that column 0 is aligned
+	const unsigned int a = alignmentPixels<T>();
+	const unsigned int left = (border + a - 1) / a * a;
+
+	m_stride = (left + width + border + a - 1) / a * a;
+	m_size = m_stride*(height + 2*border);
+
+	m_data = new T[m_size + ImageAlignment];
+	m_begin = alignedPixels(m_data);
+	m_image = m_begin + border*m_stride + left;
+}
+
+template<class T>
+Image<T>::Image(T* data, unsigned int width, unsigned int height, unsigned int stride)
+	: m_data(0), m_begin(0), m_image(data), m_width(width), m_height(height), m_stride(stride), m_border(0), m_size(0)
+{
+}
+
+template<class T>
+Image<T>::Image(Image<T>& parent, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+	: m_data(0), m_begin(0), m_image(&parent.at(x, y)), m_width(width), m_height(height), m_stride(parent.stride()), m_border(0), m_size(0)
 {
-	m_image = new T[m_width*m_height];
 }
 
 template<class T>
 Image<T>::~Image()
 {
-	if (m_image)
-		delete [] m_image;
+	if (m_data)
+		delete [] m_data;
 }
 
 template<class T>
@@ -68,9 +238,10 @@ void Image<T>::fillRectangle(int x1, int y1, int x2, int y2, const T& t)
 
 	for (int i = y1; i <= y2; ++i)
 	{
+		T* r = row(i);
 		for (int j = x1; j <= x2; ++j)
 		{
-			m_image[i*m_width+j] = t;
+			r[j] = t;
 		}
 	}
 }
@@ -78,12 +249,111 @@ void Image<T>::fillRectangle(int x1, int y1, int x2, int y2, const T& t)
 template<class T>
 void Image<T>::fill(const T& t)
 {
-	for (unsigned int i = 0; i < m_width*m_height; ++i) 
+	// A view only fills its own pixels, the rest of the rows belongs to someone else
+	if (isView())
+	{
+		for (unsigned int y = 0; y < m_height; ++y)
+		{
+			T* r = row(y);
+			for (unsigned int x = 0; x < m_width; ++x)
+				r[x] = t;
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < m_size; ++i) 
+	{
+		m_begin[i] = t;
+	}
+}
+
+
+// PlanarImage member functions
+template<class T>
+PlanarImage<T>::PlanarImage(unsigned int width, unsigned int height, unsigned int planes, unsigned int border) : m_width(width), m_height(height), m_planes(planes)
+{
+	const unsigned int a = alignmentPixels<T>();
+	const unsigned int left = (border + a - 1) / a * a;
+
+	m_stride = (left + width + border + a - 1) / a * a;
+	m_planeStride = m_stride*(height + 2*border);
+
+	m_data = new T[m_planeStride*m_planes + ImageAlignment];
+	m_begin = alignedPixels(m_data);
+	m_image = m_begin + border*m_stride + left;
+}
+
+template<class T>
+PlanarImage<T>::~PlanarImage()
+{
+	if (m_data)
+		delete [] m_data;
+}
+
+template<class T>
+void PlanarImage<T>::fill(const T& t)
+{
+	for (unsigned int i = 0; i < m_planeStride*m_planes; ++i)
+	{
+		m_begin[i] = t;
+	}
+}
+
+
+// BitImage member functions
+inline BitImage::BitImage(unsigned int width, unsigned int height) : m_width(width), m_height(height), m_bits((width + BitWordBits - 1) / BitWordBits, height)
+{
+	m_bits.fill(0);
+}
+
+inline void BitImage::fillRectangle(int x1, int y1, int x2, int y2, bool value)
+{
+	clampX(x1); clampY(y1);
+	clampX(x2); clampY(y2);
+
+	if(y1>y2) {int t=y1; y1=y2; y2=t;}
+	if(x1>x2) {int t=x1; x1=x2; x2=t;}
+
+	for (int i = y1; i <= y2; ++i)
 	{
-		m_image[i] = t;
+		BitWord* r = row(i);
+		for (int j = x1; j <= x2; ++j)
+			setBit(r, j, value);
 	}
 }
 
+inline void BitImage::fill(bool value)
+{
+	m_bits.fill(value ? ~(BitWord)0 : 0);
+
+	if (value && words())
+	{
+		for (unsigned int y = 0; y < m_height; ++y)
+			row(y)[words()-1] &= lastWordMask();
+	}
+}
+
+inline unsigned int BitImage::count() const
+{
+	unsigned int result = 0;
+
+	for (unsigned int y = 0; y < m_height; ++y)
+	{
+		const BitWord* r = row(y);
+		for (unsigned int i = 0; i < words(); ++i)
+			result += popcount(r[i]);
+	}
+
+	return result;
+}
+
+// The hard segmentation is a BitImage set at the foreground pixels
+typedef BitImage SegmentationImage;
+
+inline SegmentationValue segmentationValue(const BitWord* row, unsigned int x)
+{
+	return BitImage::bit(row, x) ? SegmentationForeground : SegmentationBackground;
+}
 
 }//ns
 
@@ -0,0 +1,200 @@
+/*
+ * GrabCut implementation source code Copyright(c) 2005-2006 Justin Talbot
+ *
+ * All Rights Reserved.
+ * For educational use only; commercial use expressly forbidden.
+ * NO WARRANTY, express or implied, for this software.
+ */
+
+#include "Superpixels.h"
+#include <vector>
+#include <limits>
+
+namespace GrabCutNS {
+
+static const unsigned int SuperpixelIterations = 10;
+static const unsigned int Unlabeled = ~0u;
+
+template <typename T, typename S>
+unsigned int computeSuperpixels(const PlanarImage<S>& channels, unsigned int size, Image<unsigned int>& regions, T compactness)
+{
+	const unsigned int w = channels.width(), h = channels.height(), n = channels.planes();
+
+	if (size < 2)
+		size = 2;
+
+	// Centers are kept planar, x, y and then the n channels, one run of K each
+	unsigned int gx = (w+size-1)/size, gy = (h+size-1)/size;
+	unsigned int K = gx*gy;
+	std::vector<T> centers((n+2)*K);
+	std::vector<double> sums((n+2)*K);
+	std::vector<unsigned int> counts(K);
+
+	for (unsigned int j = 0; j < gy; ++j)
+	{
+		for (unsigned int i = 0; i < gx; ++i)
+		{
+			unsigned int c = j*gx + i;
+			unsigned int x = i*size + size/2 < w ? i*size + size/2 : w-1;
+			unsigned int y = j*size + size/2 < h ? j*size + size/2 : h-1;
+
+			centers[c] = (T)x;
+			centers[K + c] = (T)y;
+			for (unsigned int k = 0; k < n; k++)
+				centers[(k+2)*K + c] = level<T>(channels.row(k, y)[x]);
+		}
+	}
+
+	Image<T> distances(w, h);
+	const T spatial = (compactness/size)*(compactness/size);
+	std::vector<T> offsets(2*size+1), row(2*size+1);
+
+	for (unsigned int iteration = 0; iteration < SuperpixelIterations; ++iteration)
+	{
+		distances.fill(std::numeric_limits<T>::max());
+
+		// Assignment, each center over the 2 size x 2 size window around it. The distances of a window
+		// row are summed one term at a time in straight runs, then compared.
+		for (unsigned int c = 0; c < K; ++c)
+		{
+			int cx = (int)(centers[c] + (T)0.5), cy = (int)(centers[K + c] + (T)0.5);
+			unsigned int x0 = cx > (int)size ? cx - size : 0, x1 = cx + (int)size + 1 < (int)w ? cx + size + 1 : w;
+			unsigned int y0 = cy > (int)size ? cy - size : 0, y1 = cy + (int)size + 1 < (int)h ? cy + size + 1 : h;
+			unsigned int span = x1 - x0;
+
+			for (unsigned int x = x0; x < x1; ++x)
+				offsets[x - x0] = spatial*((T)x - centers[c])*((T)x - centers[c]);
+
+			for (unsigned int y = y0; y < y1; ++y)
+			{
+				T* distance = distances.row(y) + x0;
+				unsigned int* region = regions.row(y) + x0;
+				T dy = (T)y - centers[K + c];
+				T* d = &row[0];
+
+				for (unsigned int i = 0; i < span; ++i)
+					d[i] = offsets[i] + spatial*dy*dy;
+
+				for (unsigned int k = 0; k < n; k++)
+				{
+					const S* channel = channels.row(k, y) + x0;
+					const T center = centers[(k+2)*K + c];
+					for (unsigned int i = 0; i < span; ++i)
+					{
+						T dc = level<T>(channel[i]) - center;
+						d[i] += dc*dc;
+					}
+				}
+
+				for (unsigned int i = 0; i < span; ++i)
+				{
+					bool closer = d[i] < distance[i];
+					distance[i] = closer ? d[i] : distance[i];
+					region[i] = closer ? c : region[i];
+				}
+			}
+		}
+
+		// Update, a center keeps its place if no pixel chose it
+		for (unsigned int i = 0; i < sums.size(); ++i)
+			sums[i] = 0;
+		for (unsigned int c = 0; c < K; ++c)
+			counts[c] = 0;
+
+		for (unsigned int y = 0; y < h; ++y)
+		{
+			const unsigned int* region = regions.row(y);
+			for (unsigned int x = 0; x < w; ++x)
+			{
+				unsigned int c = region[x];
+				sums[c] += x;
+				sums[K + c] += y;
+				counts[c]++;
+			}
+			for (unsigned int k = 0; k < n; k++)
+			{
+				const S* channel = channels.row(k, y);
+				for (unsigned int x = 0; x < w; ++x)
+					sums[(k+2)*K + region[x]] += level<T>(channel[x]);
+			}
+		}
+
+		for (unsigned int c = 0; c < K; ++c)
+		{
+			if (counts[c])
+			{
+				for (unsigned int k = 0; k < n+2; k++)
+					centers[k*K + c] = (T)(sums[k*K + c]/counts[c]);
+			}
+		}
+	}
+
+	// Connectivity: every 4-connected part of a cluster gets a region of its own, flooded from its first
+	// pixel in raster order. Parts too small join the region left of or above that pixel.
+	Image<unsigned int> labels(w, h);
+	labels.fill(Unlabeled);
+
+	const unsigned int minimum = size*size/4;
+	std::vector<unsigned int> part;
+	unsigned int count = 0;
+
+	for (unsigned int y = 0; y < h; ++y)
+	{
+		for (unsigned int x = 0; x < w; ++x)
+		{
+			if (labels(x, y) != Unlabeled)
+				continue;
+
+			unsigned int adjacent = Unlabeled;
+			if (x > 0)
+				adjacent = labels(x-1, y);
+			else if (y > 0)
+				adjacent = labels(x, y-1);
+
+			const unsigned int cluster = regions(x, y);
+			part.clear();
+			part.push_back(y*w + x);
+			labels(x, y) = count;
+
+			for (unsigned int i = 0; i < part.size(); ++i)
+			{
+				unsigned int px = part[i] % w, py = part[i] / w;
+				const int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+
+				for (unsigned int d = 0; d < 4; ++d)
+				{
+					unsigned int qx = px + dx[d], qy = py + dy[d];
+					if (qx < w && qy < h && labels(qx, qy) == Unlabeled && regions(qx, qy) == cluster)
+					{
+						labels(qx, qy) = count;
+						part.push_back(qy*w + qx);
+					}
+				}
+			}
+
+			if (part.size() < minimum && adjacent != Unlabeled)
+			{
+				for (unsigned int i = 0; i < part.size(); ++i)
+					labels(part[i] % w, part[i] / w) = adjacent;
+			}
+			else
+				count++;
+		}
+	}
+
+	for (unsigned int y = 0; y < h; ++y)
+	{
+		const unsigned int* label = labels.row(y);
+		unsigned int* region = regions.row(y);
+		for (unsigned int x = 0; x < w; ++x)
+			region[x] = label[x];
+	}
+
+	return count;
+}
+
+template unsigned int computeSuperpixels(const PlanarImage<float>&, unsigned int, Image<unsigned int>&, float);
+template unsigned int computeSuperpixels(const PlanarImage<double>&, unsigned int, Image<unsigned int>&, double);
+template unsigned int computeSuperpixels(const PlanarImage<unsigned char>&, unsigned int, Image<unsigned int>&, float);
+
+}
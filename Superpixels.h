@@ -0,0 +1,27 @@
+/*
+ * GrabCut implementation source code Copyright(c) 2005-2006 Justin Talbot
+ *
+ * All Rights Reserved.
+ * For educational use only; commercial use expressly forbidden.
+ * NO WARRANTY, express or implied, for this software.
+ */
+
+#ifndef SUPERPIXELS_H
+#define SUPERPIXELS_H
+
+#include "Color.h"
+#include "Image.h"
+
+namespace GrabCutNS {
+
+// SLIC superpixels (Achanta et al.) over the channel planes of an image, read in precision T (see level).
+// Seeds on a grid size pixels apart grow by k-means over color and position, a pixel only competing for
+// the seeds within size of it; compactness weighs the position term against the color one, colors being
+// in [0,1]. Every connected part of a cluster becomes a region, but for parts under a quarter of the
+// nominal size, which join a neighbor. regions receives the region of every pixel, numbered from 0;
+// returns their number.
+template <typename T, typename S>
+unsigned int computeSuperpixels(const PlanarImage<S>& channels, unsigned int size, Image<unsigned int>& regions, T compactness = (T)0.7);
+
+}
+#endif //SUPERPIXELS_H
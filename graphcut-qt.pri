@@ -6,15 +6,18 @@ HEADERS += ./mainwindow.h \
     ./maxflow/adjacency_list/block.h \
     ./maxflow/adjacency_list/graph.h \
     ./Color.h \
+    ./EigenSolver.h \
     ./Global.h \
     ./GMM.h \
     ./GrabCut.h \
-    ./Image.h
+    ./Image.h \
+    ./Superpixels.h
 SOURCES += ./main.cpp \
     ./mainwindow.cpp \
     ./maxflow/adjacency_list/graph.cpp \
     ./maxflow/adjacency_list/maxflow.cpp \
     ./Color.cpp \
     ./GMM.cpp \
-    ./GrabCut.cpp
+    ./GrabCut.cpp \
+    ./Superpixels.cpp
 RESOURCES += sdi.qrc
@@ -11,7 +11,9 @@ TEMPLATE = app
 TARGET = graphcut-qt
 QT += core gui qtmain
 INCLUDEPATH += ./maxflow/adjacency_list
-LIBS += -lcxcore200
-#LIBS += -lcxcore210
+# GMM learning passes are parallelized with OpenMP
+win32-msvc*:QMAKE_CXXFLAGS += -openmp
+unix:QMAKE_CXXFLAGS += -fopenmp
+unix:QMAKE_LFLAGS += -fopenmp
 DEPENDPATH += .
 include(graphcut-qt.pri)
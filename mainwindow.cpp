@@ -8,23 +8,21 @@ const int TOOLTIP_STRETCH = 5000;
 const int VIEWER_WIDTH = 800;
 const int VIEWER_HEIGHT = 600;
 
-GrabCutNS::Image<GrabCutNS::Color>* create_image_array_from_QImage(const QImage &img)
+// The channels are kept in 8 bits, GrabCut converts them as it reads them
+GrabCutNS::Image<GrabCutNS::Color8>* create_image_array_from_QImage(const QImage &img)
 {
 	int w = img.width();
 	int h = img.height();
 	QRgb clr;
-	GrabCutNS::Real R, G, B;
-	GrabCutNS::Image<GrabCutNS::Color> *imgArr;
-	imgArr = new GrabCutNS::Image<GrabCutNS::Color>(w, h);
+	GrabCutNS::Image<GrabCutNS::Color8> *imgArr;
+	imgArr = new GrabCutNS::Image<GrabCutNS::Color8>(w, h);
 	for (int y=0; y<h; ++y)
 	{
+		GrabCutNS::Color8* row = imgArr->row(y);
 		for (int x=0; x<w; ++x)
 		{
 			clr = img.pixel(x, y);
-			R = static_cast<GrabCutNS::Real>(qRed(clr) / 255.0f);
-			G = static_cast<GrabCutNS::Real>(qGreen(clr) / 255.0f);
-			B = static_cast<GrabCutNS::Real>(qBlue(clr) / 255.0f);
-			(*imgArr)(x,y) = GrabCutNS::Color(R, G, B);
+			row[x] = GrabCutNS::Color8(qRed(clr), qGreen(clr), qBlue(clr));
 		}
 	}
 	return imgArr;
@@ -418,8 +416,8 @@ void MainWindow::open()
 		openImage(fileName);
 		mImageArr.reset();
 		mGrabCut.reset();
-		mImageArr = std::auto_ptr<GrabCutNS::Image<GrabCutNS::Color> >(create_image_array_from_QImage(mImages[VM_IMAGE]));
-		mGrabCut = std::auto_ptr<GrabCutNS::GrabCut>(new GrabCutNS::GrabCut(mImageArr.get()));
+		mImageArr = std::auto_ptr<GrabCutNS::Image<GrabCutNS::Color8> >(create_image_array_from_QImage(mImages[VM_IMAGE]));
+		mGrabCut = std::auto_ptr<GrabCutNS::GrabCut8>(new GrabCutNS::GrabCut8(mImageArr.get()));
 
 		initSystem();
 
@@ -129,8 +129,8 @@ private:
 	ViewMode mViewMode;
 
 	// grabcut
-	std::auto_ptr<GrabCutNS::Image<GrabCutNS::Color> > mImageArr;
-	std::auto_ptr<GrabCutNS::GrabCut> mGrabCut;
+	std::auto_ptr<GrabCutNS::Image<GrabCutNS::Color8> > mImageArr;
+	std::auto_ptr<GrabCutNS::GrabCut8> mGrabCut;
 	QVector<QPoint> mPaintingPoses;
 	SelectionMode mSelectionMode;
 	bool mRefining;